@@ -0,0 +1,32 @@
+"""Repository rule that finds the headers of the local Python 3.
+
+The headers are those of the python3 on the PATH, or of the interpreter named
+by the PYTHON_BIN_PATH environment variable.
+"""
+
+def _python_configure_impl(ctx):
+    python = ctx.os.environ.get("PYTHON_BIN_PATH") or ctx.which("python3")
+    if not python:
+        fail("Cannot find python3; set PYTHON_BIN_PATH to a Python 3 interpreter")
+    result = ctx.execute([
+        python,
+        "-c",
+        "import sysconfig; print(sysconfig.get_paths()['include'])",
+    ])
+    if result.return_code != 0:
+        fail("Cannot get the Python include directory: " + result.stderr)
+    include = result.stdout.strip()
+    if not ctx.path(include + "/Python.h").exists:
+        fail("No Python.h in " + include + "; install the Python development headers")
+    ctx.symlink(include, "include")
+
+    # Like the other external BUILD files, build_file is in external/.
+    workspace = ctx.path(Label("//:WORKSPACE")).dirname
+    ctx.symlink(workspace.get_child("external").get_child(ctx.attr.build_file), "BUILD")
+
+python_configure = repository_rule(
+    implementation = _python_configure_impl,
+    attrs = {"build_file": attr.string(mandatory = True)},
+    environ = ["PATH", "PYTHON_BIN_PATH"],
+    local = True,
+)
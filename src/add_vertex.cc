@@ -6,10 +6,18 @@ Example:
 
 This example generates all 6-vertex bipartite graphs, then generates all ways of
 adding a vertex to each of them, and finally removes all isomorphic duplicates.
+
+With --depth=k, k vertices are added one after another, depth-first, without
+intermediate files. Isomorphic duplicates are removed after every addition but
+the last (and also after the last with --dedup):
+
+  $NAUTY/geng -b 6 | ./add_vertex --depth=3 | $NAUTY/shortg
 **/
 #include <algorithm>
+#include <functional>
 #include <iostream>
 #include <string>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -20,8 +28,10 @@ adding a vertex to each of them, and finally removes all isomorphic duplicates.
 #error Please compile with -DUSE_ADJACENCY_LIST.
 #endif
 
+#include "canonical.h"
 #include "common.h"
 #include "graphs.h"
+#include "io.h"
 
 DEFINE_int32(t, 1,
              "Type of vertex addition: 1 for all possible ways, "
@@ -29,13 +39,45 @@ DEFINE_int32(t, 1,
 
 DEFINE_int32(min_degree, 2, "Minimum degree if resulting vertex");
 DEFINE_bool(q, false, "Quiet mode");
+DEFINE_bool(gzip, false, "Write gzip-compressed output");
+DEFINE_int32(depth, 1, "Number of vertices to add, one after another");
+DEFINE_bool(dedup, false,
+            "Also remove isomorphic duplicates after adding the last vertex");
+DEFINE_int32(dedup_size, 10000000,
+             "Maximum number of graphs remembered per level to remove "
+             "isomorphic duplicates; beyond that some duplicates may remain");
 
 const unsigned int ALL = 1;
 const unsigned int CLONE = 2;
 const unsigned int ADJACENT_CLONE = 3;
 const unsigned int NON_ADJACENT_CLONE = 4;
 
+typedef std::function<void(const Graph &)> GraphCallback;
+
 int num_graphs = 0;
+unsigned long long num_duplicates = 0;
+
+/** Canonical forms of the graphs seen at one level of vertex additions. When
+the set reaches its maximum size it starts over, so that memory stays bounded
+at the cost of letting some duplicates through. **/
+class SeenGraphs {
+public:
+  explicit SeenGraphs(size_t max_size) : max_size_(max_size) {}
+
+  /** Adds a canonical form. Returns false if it was seen before. **/
+  bool Insert(const std::string &canonical_form) {
+    if (seen_.size() >= max_size_) {
+      seen_.clear();
+    }
+    return seen_.insert(canonical_form).second;
+  }
+
+private:
+  size_t max_size_;
+  std::unordered_set<std::string> seen_;
+};
+
+std::vector<SeenGraphs> seen_graphs;
 
 void ParseCommandLineFlags(int argc, char *argv[]) {
   gflags::SetUsageMessage("Adds vertices to Nauty-generated graphs.");
@@ -43,7 +85,8 @@ void ParseCommandLineFlags(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 }
 
-void GenerateAllVertexAdditions(const Graph &graph) {
+void GenerateAllVertexAdditions(const Graph &graph,
+                                const GraphCallback &callback) {
   const unsigned int num_vertices = boost::num_vertices(graph);
 
   // Generate all possible ways of adding one more vertex.
@@ -62,13 +105,13 @@ void GenerateAllVertexAdditions(const Graph &graph) {
       }
     }
     if (degree >= FLAGS_min_degree) {
-      ++num_graphs;
-      WriteGraph(new_graph);
+      callback(new_graph);
     }
   }
 }
 
-void GenerateClones(const Graph &graph, bool adjacent) {
+void GenerateClones(const Graph &graph, bool adjacent,
+                    const GraphCallback &callback) {
   const unsigned int num_vertices = boost::num_vertices(graph);
 
   for (unsigned int i = 0; i < num_vertices; ++i) {
@@ -89,14 +132,55 @@ void GenerateClones(const Graph &graph, bool adjacent) {
       }
     }
     if (degree >= FLAGS_min_degree) {
+      callback(new_graph);
+    }
+  }
+}
+
+void GenerateVertexAdditions(const Graph &graph,
+                             const GraphCallback &callback) {
+  if (FLAGS_t == ALL) {
+    GenerateAllVertexAdditions(graph, callback);
+  } else if (FLAGS_t == CLONE) {
+    GenerateClones(graph, true, callback);
+    GenerateClones(graph, false, callback);
+  } else if (FLAGS_t == ADJACENT_CLONE) {
+    GenerateClones(graph, true, callback);
+  } else if (FLAGS_t == NON_ADJACENT_CLONE) {
+    GenerateClones(graph, false, callback);
+  }
+}
+
+/** Adds a vertex to a graph to which level vertices were added already, and
+recurses until FLAGS_depth vertices were added; then writes the graph. **/
+void ExtendGraph(const Graph &graph, int level) {
+  GenerateVertexAdditions(graph, [level](const Graph &new_graph) {
+    const bool last = (level + 1 == FLAGS_depth);
+    if ((!last || FLAGS_dedup) &&
+        !seen_graphs[level].Insert(CanonicalForm(new_graph))) {
+      ++num_duplicates;
+      return;
+    }
+    if (last) {
       ++num_graphs;
       WriteGraph(new_graph);
+    } else {
+      ExtendGraph(new_graph, level + 1);
     }
-  }
+  });
 }
 
 int main(int argc, char *argv[]) {
   ParseCommandLineFlags(argc, argv);
+  SetOutputCompression(FLAGS_gzip);
+
+  if (FLAGS_depth < 1) {
+    Error("Depth must be at least 1");
+  }
+  if (FLAGS_dedup_size < 1) {
+    Error("Dedup size must be at least 1");
+  }
+  seen_graphs.assign(FLAGS_depth, SeenGraphs(FLAGS_dedup_size));
 
   auto begin_time = Clock::now();
   if (!FLAGS_q) {
@@ -105,23 +189,13 @@ int main(int argc, char *argv[]) {
 
   boost::optional<Graph> optional_graph;
   while ((optional_graph = ReadGraph())) {
-    Graph graph = optional_graph.get();
-
-    if (FLAGS_t == ALL) {
-      GenerateAllVertexAdditions(graph);
-    } else if (FLAGS_t == CLONE) {
-      GenerateClones(graph, true);
-      GenerateClones(graph, false);
-    } else if (FLAGS_t == ADJACENT_CLONE) {
-      GenerateClones(graph, true);
-    } else if (FLAGS_t == NON_ADJACENT_CLONE) {
-      GenerateClones(graph, false);
-    }
+    ExtendGraph(optional_graph.get(), 0);
   }
 
   if (!FLAGS_q) {
     std::cerr << ">Z add_vertex generated " << num_graphs << " graphs in "
-              << GetMillisecondsSince(begin_time) / 1000.0 << " seconds"
+              << GetMillisecondsSince(begin_time) / 1000.0 << " seconds ("
+              << num_duplicates << " isomorphic duplicates removed)"
               << std::endl;
   }
   return 0;
@@ -41,6 +41,25 @@ class AddVertexTest(unittest.TestCase):
     self.assertIn(':EgGEQg~', stdout)  # C5 with non-adjacent clone
     self.assertEqual(len(set(stdout)), 5)
 
+  def testDepth(self):
+    # The adjacent clones of C5 are all isomorphic, so only one of them is
+    # extended further.
+    stdout, stderr = RunAddVertex(self.C5, ['-t=3', '--depth=2'])
+    self.assertEqual(len(stdout), 6)
+    self.assertTrue(all(line.startswith(':F') for line in stdout))
+
+  def testDepthDedup(self):
+    stdout, stderr = RunAddVertex(self.C5, ['--depth=2', '--dedup'])
+    self.assertEqual(len(stdout), 100)
+    self.assertEqual(len(set(stdout)), 100)
+
+  def testInvalidFlags(self):
+    _, stderr = RunAddVertex(self.C5, ['--depth=0'])
+    self.assertEqual(stderr, ['ERROR: Depth must be at least 1'])
+    for dedup_size in ['0', '-1']:
+      _, stderr = RunAddVertex(self.C5, ['--dedup_size=' + dedup_size])
+      self.assertEqual(stderr, ['ERROR: Dedup size must be at least 1'])
+
 
 if __name__ == '__main__':
     unittest.main()
\ No newline at end of file
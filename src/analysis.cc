@@ -1,4 +1,5 @@
 #include <bitset>
+#include <cstdint>
 #include <iostream>
 
 #include "src/analysis.h"
@@ -42,6 +43,7 @@ bool AnalyzeMetricSpace(const int num_vertices, const DistanceMatrixMap& dist,
     Error("Metric space too large");
   }
   const unsigned long universal_line = (1L << num_vertices) - 1;
+  info->has_universal_line = false;
   // Get set of lines.
   std::bitset<(1 << MAX_N)> lines;
   std::bitset<(1 << MAX_N)> lines_dist1;
@@ -84,6 +86,7 @@ bool AnalyzeMetricSpace(const int num_vertices, const DistanceMatrixMap& dist,
       }
       // If this line is the universal line, do additional counting.
       if (line == universal_line) {
+        info->has_universal_line = true;
         if (options.skip_spaces_with_universal_line) {
           return false;
         }
@@ -113,3 +116,122 @@ bool AnalyzeMetricSpace(const int num_vertices, const DistanceMatrixMap& dist,
   info->amrz_gap = info->num_lines + info->num_universal - info->num_vertices;
   return true;
 }
+
+void AnalyzeMetricSpaces(const int num_vertices, const int batch_size,
+                         const int *distances, const AnalysisOptions &options,
+                         MetricSpaceInfo *infos, bool *valid) {
+  if (num_vertices > MAX_N) {
+    Error("Metric space too large");
+  }
+  if (batch_size > MAX_BATCH_SIZE) {
+    Error("Batch too large");
+  }
+  const int n = num_vertices;
+  const uint32_t universal_line = (1u << n) - 1;
+  auto dist = [&](int i, int j) { return distances + (i * n + j) * batch_size; };
+
+  // Get the line of every pair in every metric space. The innermost loop runs
+  // over the metric spaces, so that it vectorizes.
+  uint32_t lines[MAX_N * (MAX_N - 1) / 2][MAX_BATCH_SIZE];
+  int num_pairs = 0;
+  for (int i = 0; i < n; ++i) {
+    for (int j = i + 1; j < n; ++j, ++num_pairs) {
+      uint32_t *line = lines[num_pairs];
+      const int *dij = dist(i, j);
+      for (int b = 0; b < batch_size; ++b) {
+        line[b] = (1u << i) | (1u << j);
+      }
+      for (int k = 0; k < n; ++k) {
+        if ((k == i) || (k == j)) {
+          continue;
+        }
+        const int *dik = dist(i, k);
+        const int *djk = dist(j, k);
+        const uint32_t mask = 1u << k;
+        for (int b = 0; b < batch_size; ++b) {
+          // i-j-k or j-i-k or i-k-j
+          const bool on_line = (dij[b] + djk[b] == dik[b]) |
+                               (dij[b] + dik[b] == djk[b]) |
+                               (dik[b] + djk[b] == dij[b]);
+          line[b] |= on_line ? mask : 0;
+        }
+      }
+    }
+  }
+
+  // Count the lines of each metric space, exactly as AnalyzeMetricSpace does.
+  // Distinct lines are counted with bitsets that are cleared after each
+  // metric space by unsetting just the bits that were set.
+  std::bitset<(1 << MAX_N)> seen;
+  std::bitset<(1 << MAX_N)> seen_dist1;
+  std::bitset<(1 << MAX_N)> seen_dist2;
+  for (int b = 0; b < batch_size; ++b) {
+    MetricSpaceInfo &info = infos[b];
+    info = MetricSpaceInfo();
+    valid[b] = true;
+    int p = 0;
+    for (int i = 0; (i < n) && valid[b]; ++i) {
+      for (int j = i + 1; j < n; ++j, ++p) {
+        const int d = dist(i, j)[b];
+        const uint32_t line = lines[p][b];
+        if (options.include_universal_in_lines || (line != universal_line)) {
+          if ((d >= options.dmin) && (d <= options.dmax)) {
+            ++info.num_line_pairs;
+            if (!seen.test(line)) {
+              seen.set(line);
+              ++info.num_lines;
+            }
+          }
+          if (options.count_lines_by_distance) {
+            if ((d == 1) && !seen_dist1.test(line)) {
+              seen_dist1.set(line);
+              ++info.num_lines_dist1;
+            } else if ((d == 2) && !seen_dist2.test(line)) {
+              seen_dist2.set(line);
+              ++info.num_lines_dist2;
+            }
+          }
+        }
+        if (line == universal_line) {
+          info.has_universal_line = true;
+          if (options.skip_spaces_with_universal_line) {
+            valid[b] = false;
+            ++p;
+            break;
+          }
+          if ((d >= options.dumin) && (d <= options.dumax)) {
+            ++info.num_universal;
+            if (d == 1) {
+              ++info.num_universal_dist1;
+            } else if (d == 2) {
+              ++info.num_universal_dist2;
+            }
+          }
+        }
+      }
+    }
+    for (int q = 0; q < p; ++q) {
+      seen.reset(lines[q][b]);
+      seen_dist1.reset(lines[q][b]);
+      seen_dist2.reset(lines[q][b]);
+    }
+    info.num_vertices = n;
+    info.amrz_gap = info.num_lines + info.num_universal - info.num_vertices;
+  }
+}
+
+bool AcceptMetricSpace(const MetricSpaceInfo &info, const FilterOptions &filter) {
+  if (filter.skip_universal_line && info.has_universal_line) {
+    // Skip because this metric space has a universal line.
+    return false;
+  } else if (filter.skip_n_lines && info.num_lines >= info.num_vertices) {
+    // Skip because this metric space has as many lines as vertices.
+    return false;
+  } else if ((info.amrz_gap < filter.zmin) || (info.amrz_gap > filter.zmax)) {
+    // Skip because this metric space an AMRZ gap outside the requested range.
+    return false;
+  } else if ((info.num_lines < filter.nmin) || (info.num_lines > filter.nmax)) {
+    return false;
+  }
+  return true;
+}
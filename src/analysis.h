@@ -1,9 +1,12 @@
 #ifndef __ANALYSIS_H__
 #define __ANALYSIS_H__
 
+#include <climits>
+
 #include "src/graphs.h"
 
 const int MAX_N = 14;
+const int MAX_BATCH_SIZE = 32;
 
 struct AnalysisOptions {
   bool verbose = false;
@@ -27,9 +30,32 @@ struct MetricSpaceInfo {
   int num_vertices = 0;
   int num_line_pairs = 0;
   int amrz_gap = 0;
+  bool has_universal_line = false;
+};
+
+struct FilterOptions {
+  bool skip_universal_line = false;
+  bool skip_n_lines = false;
+  int nmin = 0;
+  int nmax = INT_MAX;
+  int zmin = INT_MIN;
+  int zmax = INT_MAX;
 };
 
 bool AnalyzeMetricSpace(const int num_vertices, const DistanceMatrixMap& dist,
                         const AnalysisOptions &options, MetricSpaceInfo *info);
 
+/** Analyzes a batch of metric spaces with the same number of points at once,
+one metric space per vector lane. The distances are laid out structure of
+arrays: the distance between points i and j in metric space b is
+distances[(i * num_vertices + j) * batch_size + b]. For each metric space b,
+valid[b] and infos[b] are set as by AnalyzeMetricSpace. Verbose output is not
+supported. **/
+void AnalyzeMetricSpaces(const int num_vertices, const int batch_size,
+                         const int *distances, const AnalysisOptions &options,
+                         MetricSpaceInfo *infos, bool *valid);
+
+/** Determines whether an analyzed metric space passes the given filter. **/
+bool AcceptMetricSpace(const MetricSpaceInfo &info, const FilterOptions &filter);
+
 #endif
@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "src/cache.h"
+#include "src/canonical.h"
+#include "src/common.h"
+
+namespace {
+
+const char kMagic[8] = {'D', 'B', 'E', 'C', 'A', 'C', 'H', 'E'};
+const uint32_t kVersion = 1;
+const size_t kMaxPendingRecords = 4096;
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+
+static_assert(sizeof(CacheRecord) == 64, "Unexpected cache record size");
+
+// Keys of graphs were once hashes of their labels as given, rather than of
+// their canonical forms, hence the gap.
+const uint64_t kDistanceMatrixDomain = 2;
+const uint64_t kGraphDomain = 3;
+
+/** Finalizer of splitmix64. **/
+uint64_t Mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/** Hashes a byte string to 128 bits with two independent FNV-1a streams. **/
+CacheKey Hash(const void *data, size_t length, uint64_t seed) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  uint64_t hi = 0xcbf29ce484222325ULL ^ Mix(seed);
+  uint64_t lo = 0x84222325cbf29ce4ULL ^ Mix(~seed);
+  for (size_t i = 0; i < length; ++i) {
+    hi = (hi ^ bytes[i]) * 0x100000001b3ULL;
+    lo = (lo ^ bytes[i]) * 0x100000001b3ULL;
+    lo ^= lo >> 29;
+  }
+  CacheKey key;
+  key.hi = Mix(hi ^ length);
+  key.lo = Mix(lo + key.hi);
+  return key;
+}
+
+uint64_t Checksum(const CacheRecord &record) {
+  return Hash(&record, offsetof(CacheRecord, checksum), 0).lo;
+}
+
+void Lock(int fd) {
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      Error("Cannot lock result cache");
+    }
+  }
+}
+
+void Unlock(int fd) { flock(fd, LOCK_UN); }
+
+void WriteFully(int fd, const void *data, size_t length) {
+  const char *p = static_cast<const char *>(data);
+  while (length > 0) {
+    ssize_t num_written = write(fd, p, length);
+    if (num_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Error("Cannot write result cache");
+    }
+    p += num_written;
+    length -= num_written;
+  }
+}
+
+}  // namespace
+
+ResultCache::ResultCache(const std::string &path,
+                         const AnalysisOptions &options) {
+  const int option_values[] = {
+      static_cast<int>(kVersion),     options.dmin,
+      options.dmax,                   options.dumin,
+      options.dumax,                  options.include_universal_in_lines,
+      options.count_lines_by_distance};
+  options_hash_ = Hash(option_values, sizeof(option_values), 0).hi;
+
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd_ < 0) {
+    Error("Cannot open result cache " + path);
+  }
+
+  // Write the header if this process is the first to use the file.
+  Lock(fd_);
+  struct stat status;
+  if (fstat(fd_, &status) != 0) {
+    Error("Cannot stat result cache " + path);
+  }
+  if (status.st_size == 0) {
+    CacheHeader header;
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.record_size = sizeof(CacheRecord);
+    WriteFully(fd_, &header, sizeof(header));
+    status.st_size = sizeof(header);
+  }
+  Unlock(fd_);
+
+  if (status.st_size < static_cast<off_t>(sizeof(CacheHeader))) {
+    Error("Not a result cache: " + path);
+  }
+  Map(status.st_size);
+  const CacheHeader *header = static_cast<const CacheHeader *>(mapping_);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion ||
+      header->record_size != sizeof(CacheRecord)) {
+    Error("Not a result cache: " + path);
+  }
+  IndexRecords(0);
+}
+
+ResultCache::~ResultCache() {
+  Flush();
+  munmap(mapping_, mapping_size_);
+  close(fd_);
+}
+
+void ResultCache::Map(size_t size) {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  }
+  mapping_size_ = size;
+  mapping_ = mmap(nullptr, mapping_size_, PROT_READ, MAP_SHARED, fd_, 0);
+  if (mapping_ == MAP_FAILED) {
+    Error("Cannot map result cache");
+  }
+  records_ = reinterpret_cast<const CacheRecord *>(
+      static_cast<const char *>(mapping_) + sizeof(CacheHeader));
+  num_records_ = (mapping_size_ - sizeof(CacheHeader)) / sizeof(CacheRecord);
+}
+
+/** Indexes the valid records from the given one onwards, growing the index as
+needed. If a metric space occurs more than once, the first record is used. **/
+void ResultCache::IndexRecords(size_t begin) {
+  if (index_.empty() ||
+      2 * (num_indexed_ + num_records_ - begin) > index_.size()) {
+    // Leave room for as many records again before the next rebuild.
+    size_t capacity = 1;
+    while (capacity < 4 * num_records_) {
+      capacity <<= 1;
+    }
+    index_.assign(capacity, 0);
+    num_indexed_ = 0;
+    begin = 0;
+  }
+  const size_t mask = index_.size() - 1;
+  for (size_t i = begin; i < num_records_; ++i) {
+    const CacheRecord &record = records_[i];
+    if (record.checksum != Checksum(record)) {
+      continue;
+    }
+    for (size_t slot = record.key_lo & mask;; slot = (slot + 1) & mask) {
+      if (index_[slot] == 0) {
+        index_[slot] = i + 1;
+        ++num_indexed_;
+        break;
+      }
+      const CacheRecord &other = records_[index_[slot] - 1];
+      if (other.key_hi == record.key_hi && other.key_lo == record.key_lo) {
+        break;
+      }
+    }
+  }
+}
+
+const CacheRecord *ResultCache::Find(uint64_t key_hi, uint64_t key_lo) const {
+  const size_t mask = index_.size() - 1;
+  for (size_t slot = key_lo & mask; index_[slot] != 0;
+       slot = (slot + 1) & mask) {
+    const CacheRecord &record = records_[index_[slot] - 1];
+    if (record.key_hi == key_hi && record.key_lo == key_lo) {
+      return &record;
+    }
+  }
+  return nullptr;
+}
+
+CacheKey ResultCache::GraphKey(const Graph &graph) const {
+  const std::string canonical_form = CanonicalForm(graph);
+  return Hash(canonical_form.data(), canonical_form.size(),
+              options_hash_ ^ kGraphDomain);
+}
+
+CacheKey ResultCache::DistanceMatrixKey(int num_vertices,
+                                        const DistanceMatrixMap &dist) const {
+  std::vector<int> values = {num_vertices};
+  for (int i = 0; i < num_vertices; ++i) {
+    for (int j = i + 1; j < num_vertices; ++j) {
+      values.push_back(dist[i][j]);
+    }
+  }
+  return Hash(values.data(), values.size() * sizeof(int),
+              options_hash_ ^ kDistanceMatrixDomain);
+}
+
+bool ResultCache::Lookup(const CacheKey &key, MetricSpaceInfo *info) {
+  const CacheRecord *record = Find(key.hi, key.lo);
+  if (record == nullptr) {
+    ++num_misses_;
+    return false;
+  }
+  const int32_t *values = record->values;
+  info->num_lines = values[0];
+  info->num_lines_dist1 = values[1];
+  info->num_lines_dist2 = values[2];
+  info->num_universal = values[3];
+  info->num_universal_dist1 = values[4];
+  info->num_universal_dist2 = values[5];
+  info->num_vertices = values[6];
+  info->num_line_pairs = values[7];
+  info->amrz_gap = values[8];
+  info->has_universal_line = values[9];
+  ++num_hits_;
+  return true;
+}
+
+void ResultCache::Insert(const CacheKey &key, const MetricSpaceInfo &info) {
+  CacheRecord record;
+  memset(&record, 0, sizeof(record));
+  record.key_hi = key.hi;
+  record.key_lo = key.lo;
+  int32_t *values = record.values;
+  values[0] = info.num_lines;
+  values[1] = info.num_lines_dist1;
+  values[2] = info.num_lines_dist2;
+  values[3] = info.num_universal;
+  values[4] = info.num_universal_dist1;
+  values[5] = info.num_universal_dist2;
+  values[6] = info.num_vertices;
+  values[7] = info.num_line_pairs;
+  values[8] = info.amrz_gap;
+  values[9] = info.has_universal_line;
+  record.checksum = Checksum(record);
+  pending_.push_back(record);
+  if (pending_.size() >= kMaxPendingRecords) {
+    Flush();
+  }
+}
+
+void ResultCache::Flush() {
+  if (pending_.empty()) {
+    return;
+  }
+  Lock(fd_);
+  // Drop a partial record left behind by a process that died while
+  // appending, so that the records that follow stay aligned.
+  const off_t size = lseek(fd_, 0, SEEK_END);
+  const off_t excess = (size - sizeof(CacheHeader)) % sizeof(CacheRecord);
+  if (excess != 0 && ftruncate(fd_, size - excess) != 0) {
+    Error("Cannot truncate result cache");
+  }
+
+  // Skip results that are in the file already, because another process
+  // appended them since this one last looked, or that were recorded twice.
+  size_t num_records = num_records_;
+  Map(size - excess);
+  IndexRecords(num_records);
+  std::sort(pending_.begin(), pending_.end(),
+            [](const CacheRecord &a, const CacheRecord &b) {
+              return a.key_hi != b.key_hi ? a.key_hi < b.key_hi
+                                          : a.key_lo < b.key_lo;
+            });
+  std::vector<CacheRecord> new_records;
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    const CacheRecord &record = pending_[i];
+    if ((i > 0 && record.key_hi == pending_[i - 1].key_hi &&
+         record.key_lo == pending_[i - 1].key_lo) ||
+        Find(record.key_hi, record.key_lo) != nullptr) {
+      continue;
+    }
+    new_records.push_back(record);
+  }
+  WriteFully(fd_, new_records.data(), new_records.size() * sizeof(CacheRecord));
+
+  num_records = num_records_;
+  Map(size - excess + new_records.size() * sizeof(CacheRecord));
+  IndexRecords(num_records);
+  Unlock(fd_);
+  pending_.clear();
+}
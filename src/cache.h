@@ -0,0 +1,86 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "src/analysis.h"
+#include "src/graphs.h"
+
+/** 128-bit key identifying a metric space, together with the analysis
+options that affect its MetricSpaceInfo. **/
+struct CacheKey {
+  uint64_t hi = 0;
+  uint64_t lo = 0;
+};
+
+/** On-disk record of the analysis of a single metric space. **/
+struct CacheRecord {
+  uint64_t key_hi;
+  uint64_t key_lo;
+  int32_t values[10];
+  uint64_t checksum;
+};
+
+/** Persistent store of analysis results.
+
+The store is a file of fixed-size records that is only ever appended to, so
+any number of processes can share it: appends are done in batches under an
+exclusive flock(2). The records are memory-mapped and indexed on opening, and
+again on every append, which makes the records added by other processes
+visible, and skips results that another process has recorded in the meantime,
+so that the file only grows with new metric spaces. **/
+class ResultCache {
+public:
+  /** Opens the store at the given path, creating it if it does not exist.
+  Only results obtained with the given options are visible. **/
+  ResultCache(const std::string &path, const AnalysisOptions &options);
+  ~ResultCache();
+
+  /** Gets the key of the metric space of a graph. Isomorphic graphs have the
+  same key. This computes the canonical labelling of the graph with nauty. **/
+  CacheKey GraphKey(const Graph &graph) const;
+
+  /** Gets the key of a metric space that is identified by its distances. **/
+  CacheKey DistanceMatrixKey(int num_vertices,
+                             const DistanceMatrixMap &dist) const;
+
+  /** Looks up the analysis of a metric space. **/
+  bool Lookup(const CacheKey &key, MetricSpaceInfo *info);
+
+  /** Records the analysis of a metric space. **/
+  void Insert(const CacheKey &key, const MetricSpaceInfo &info);
+
+  /** Appends all results recorded so far, except those already in the file,
+  to the file. **/
+  void Flush();
+
+  unsigned long long num_hits() const { return num_hits_; }
+  unsigned long long num_misses() const { return num_misses_; }
+
+private:
+  /** Maps the complete records in the first size bytes of the file. **/
+  void Map(size_t size);
+
+  /** Indexes the mapped records from the given one onwards. **/
+  void IndexRecords(size_t begin);
+
+  /** Finds the record with the given key, or returns nullptr. **/
+  const CacheRecord *Find(uint64_t key_hi, uint64_t key_lo) const;
+
+  int fd_;
+  uint64_t options_hash_;
+  const CacheRecord *records_ = nullptr;
+  size_t num_records_ = 0;
+  void *mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  // Open-addressing hash table of record index + 1, or 0 for an empty slot.
+  std::vector<uint64_t> index_;
+  size_t num_indexed_ = 0;
+  std::vector<CacheRecord> pending_;
+  unsigned long long num_hits_ = 0;
+  unsigned long long num_misses_ = 0;
+};
+
+#endif
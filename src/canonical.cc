@@ -0,0 +1,22 @@
+#include <vector>
+
+#include "canonical.h"
+
+/** Gets the graph6 encoding of the canonical labelling of a graph, which is
+the same for all graphs isomorphic to it. **/
+std::string CanonicalForm(const Graph &graph) {
+  const int n = boost::num_vertices(graph);
+  const int m = SETWORDSNEEDED(n);
+  std::vector<setword> g(static_cast<size_t>(m) * n);
+  std::vector<setword> h(static_cast<size_t>(m) * n);
+  for (int i = 0; i < n; ++i) {
+    for (int j = i + 1; j < n; ++j) {
+      if (boost::edge(i, j, graph).second) {
+        ADDONEEDGE(g.data(), i, j, m);
+      }
+    }
+  }
+  fcanonise(g.data(), m, n, h.data(), nullptr, FALSE);
+  // Note: the result refers to a global buffer in gtools.c.
+  return ntog6(h.data(), m, n);
+}
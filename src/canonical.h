@@ -0,0 +1,12 @@
+#ifndef __CANONICAL_H__
+#define __CANONICAL_H__
+
+#include <string>
+
+#include "graphs.h"
+
+/** Gets the graph6 encoding of the canonical labelling of a graph, which is
+the same for all graphs isomorphic to it. **/
+std::string CanonicalForm(const Graph &graph);
+
+#endif
@@ -3,51 +3,82 @@
 Example usage:
 
     NAUTY="../nauty26r11"
-    $NAUTY/geng -b -C 6 | ./dbe | $NAUTY/showg -A
+    $NAUTY/geng -b -C 6 | ./dbe -g | $NAUTY/showg -A
 **/
 
 #include <algorithm>
 #include <chrono>
+#include <cctype>
+#include <cerrno>
 #include <climits>
+#include <cstdlib>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <gflags/gflags.h>
 
 #include "src/analysis.h"
+#include "src/cache.h"
 #include "src/common.h"
+#include "src/dbe_flags.h"
+#include "src/distributed.h"
 #include "src/graphs.h"
+#include "src/io.h"
+#include "src/prefilters.h"
 
-DEFINE_bool(v, false, "Verbose analysis");
 DEFINE_bool(q, false, "Quiet mode");
-DEFINE_bool(p, true, "Include universal line in line counts");
-DEFINE_bool(n, false, "Do not output metric spaces with |X| lines");
-DEFINE_int32(nmin, 0,
-             "Only output metric spaces with at least this many distinct lines");
-DEFINE_int32(nmax, INT_MAX,
-             "Only output metric spaces with at most this many distinct lines");
-DEFINE_int32(dmin, 0,
-             "Only count lines generated by pairs of vertices at at least this "
-             "distance");
-DEFINE_int32(dmax, INT_MAX,
-             "Only count lines generated by pairs of vertices at at "
-             "most this distance");
-DEFINE_bool(u, false, "Do not output metric spaces with a universal line");
-DEFINE_int32(dumin, 0,
-             "Among pairs that generate the universal line, only count pairs "
-             "at at most this distance");
-DEFINE_int32(dumax, INT_MAX,
-             "Among pairs that generate the universal line, only count pairs "
-             "at at least this distance");
-DEFINE_int32(zmin, INT_MIN,
-             "Only output metric spaces with a AMRZ gap of at least this number");
-DEFINE_int32(zmax, INT_MAX,
-             "Only output metric spaces with a AMRZ gap of at most this number");
+DEFINE_bool(gzip, false, "Write gzip-compressed output");
 DEFINE_int32(o, 0, "Output format");
+DEFINE_string(cache, "",
+              "Persistent result cache file to look up and record analyses in");
+DEFINE_string(queries, "",
+              "File of queries, one per line, each an output file ('-' for "
+              "stdout) followed by filter flags (-u, -n, -nmin, -nmax, -zmin, "
+              "-zmax); replaces the filter flags on the command line");
+DEFINE_int32(coordinator, -1,
+             "Run as coordinator: hand out the input to workers that connect "
+             "to this TCP port");
+DEFINE_string(worker, "",
+              "Run as worker: analyze input from the coordinator at "
+              "host:port, applying the filter flags on the command line");
+DEFINE_int32(batch_size, 16,
+             "Number of consecutive metric spaces of the same size to analyze "
+             "together (at most 32; 1 to analyze them one by one)");
+DEFINE_bool(g, false,
+            "Read graphs in graph6 or sparse6 format instead of distance "
+            "matrices, and compute their distances");
+DEFINE_bool(prefilters, true,
+            "With -g and -u, reject graphs by cheap structural tests before "
+            "computing their distances");
+DEFINE_int32(unit_size, 10000,
+             "Number of metric spaces in each unit handed out by the "
+             "coordinator");
+DEFINE_int32(unit_timeout, 3600,
+             "Seconds a worker may take for a unit before the coordinator "
+             "hands it to another worker (0 for no limit)");
+DEFINE_int32(grace_period, 10,
+             "Seconds for which the coordinator, once all work is done, "
+             "keeps telling workers that connect late that there is no more "
+             "work");
+
+/** A filter whose accepted metric spaces are written to their own output. **/
+struct Query {
+  std::string path;
+  FilterOptions filter;
+  int fd = -1;
+  std::unique_ptr<OutputWriter> writer;
+  unsigned long long num_output_metric_spaces = 0;
+};
 
 void ParseCommandLineFlags(int argc, char *argv[]) {
   gflags::SetUsageMessage("De Bruijn-Erdos checker.");
@@ -69,99 +100,636 @@ std::string Values(const MetricSpaceInfo &info, int num_bridges) {
   return ss.str();
 }
 
-bool ReadMetricSpace(Graph& graph, DistanceMatrix& distance_matrix, std::string& label) {
-  boost::optional<std::string> line;
-  line = ReadLine();
-  if (!line) {
+/** Parses the value of a boolean query flag the way gflags does. **/
+bool ParseBoolValue(const std::string &flag, std::string value) {
+  std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+  if (value == "true" || value == "t" || value == "yes" || value == "y" ||
+      value == "1") {
+    return true;
+  }
+  if (value == "false" || value == "f" || value == "no" || value == "n" ||
+      value == "0") {
     return false;
   }
+  Error("Invalid value for query flag " + flag + ": " + value);
+  return false;
+}
 
-  std::stringstream stream(line.get());
-  int num_points;
-  stream >> num_points;
-  distance_matrix = DistanceMatrix(num_points);
-  graph = Graph(num_points);  // dummy graph
-  DistanceMatrixMap dist(distance_matrix, graph);
+/** Parses the value of an integer query flag. **/
+int ParseIntValue(const std::string &flag, const std::string &value) {
+  const char *begin = value.c_str();
+  char *end;
+  errno = 0;
+  const long result = strtol(begin, &end, 10);
+  if (end == begin || *end != '\0' || errno != 0 || result < INT_MIN ||
+      result > INT_MAX) {
+    Error("Invalid value for query flag " + flag + ": " + value);
+  }
+  return result;
+}
+
+/** Parses the filter flags of a query. As on the command line, flags start with
+- or --, and their values follow after = or, for integer flags, as the next
+word. **/
+FilterOptions ParseQueryFilter(std::stringstream &stream) {
+  FilterOptions filter;
+  std::string flag;
+  while (stream >> flag) {
+    const size_t equals = flag.find('=');
+    std::string name = flag.substr(0, equals);
+    if (name.compare(0, 2, "--") == 0) {
+      name.erase(0, 1);
+    }
+    const bool has_value = (equals != std::string::npos);
+    std::string value = has_value ? flag.substr(equals + 1) : "";
+    if (name == "-u" || name == "-n") {
+      const bool enabled = !has_value || ParseBoolValue(name, value);
+      if (name == "-u") {
+        filter.skip_universal_line = enabled;
+      } else {
+        filter.skip_n_lines = enabled;
+      }
+      continue;
+    }
+    if (name != "-nmin" && name != "-nmax" && name != "-zmin" &&
+        name != "-zmax") {
+      Error("Invalid query flag: " + flag);
+    }
+    if (!has_value && !(stream >> value)) {
+      Error("Missing value for query flag " + name);
+    }
+    const int number = ParseIntValue(name, value);
+    if (name == "-nmin") {
+      filter.nmin = number;
+    } else if (name == "-nmax") {
+      filter.nmax = number;
+    } else if (name == "-zmin") {
+      filter.zmin = number;
+    } else {
+      filter.zmax = number;
+    }
+  }
+  return filter;
+}
+
+/** Reads the queries from a file and opens their outputs. Empty lines and
+lines starting with '#' are ignored. **/
+std::vector<Query> ReadQueries(const std::string &path) {
+  std::ifstream file(path);
+  if (!file) {
+    Error("Cannot open query file " + path);
+  }
+  std::vector<Query> queries;
+  std::vector<std::pair<dev_t, ino_t>> files;
+  std::string line;
+  while (std::getline(file, line)) {
+    std::stringstream stream(line);
+    Query query;
+    if (!(stream >> query.path) || query.path[0] == '#') {
+      continue;
+    }
+    query.filter = ParseQueryFilter(stream);
+    // Queries writing to the same output would overwrite each other.
+    for (const Query &other : queries) {
+      if (other.path == query.path) {
+        Error("Duplicate query output " + query.path);
+      }
+    }
+    if (query.path != "-") {
+      // Open without truncating, so that an output that is another query's
+      // under a different name is found before it is emptied.
+      query.fd = open(query.path.c_str(), O_WRONLY | O_CREAT, 0644);
+      struct stat status;
+      if (query.fd < 0 || fstat(query.fd, &status) != 0) {
+        Error("Cannot open query output " + query.path);
+      }
+      const std::pair<dev_t, ino_t> id(status.st_dev, status.st_ino);
+      if (std::find(files.begin(), files.end(), id) != files.end()) {
+        Error("Duplicate query output " + query.path);
+      }
+      files.push_back(id);
+      if (S_ISREG(status.st_mode) && ftruncate(query.fd, 0) != 0) {
+        Error("Cannot truncate query output " + query.path);
+      }
+      query.writer.reset(new OutputWriter(query.fd, FLAGS_gzip));
+    }
+    queries.push_back(std::move(query));
+  }
+  if (queries.empty()) {
+    Error("No queries in " + path);
+  }
+  return queries;
+}
+
+/** Formats an accepted metric space according to the output format. **/
+std::string FormatOutput(const MetricSpaceInfo &info,
+                         const std::string &label) {
+  if (FLAGS_o == 0) {
+    return label + "\n";
+  } else if (FLAGS_o == 1) {
+    return std::to_string(info.num_lines) + "," +
+           std::to_string(info.num_universal) + "," +
+           std::to_string(info.amrz_gap) + "\n";
+  }
+  return "";
+}
+
+/** Parses a metric space from an input line, which holds the number of points,
+the distances above the diagonal, and a label. First calls reserve with the
+number of points, and returns false if that does; then calls set(i, j, d) for
+every distance d between points i < j. **/
+template <class R, class S>
+bool ParseMetricSpace(const std::string &line, R reserve, S set,
+                      std::string *label) {
+  const char *p = line.c_str();
+  char *end;
+  const long num_points = strtol(p, &end, 10);
+  if (end == p || num_points < 0 || num_points > INT_MAX) {
+    Error("Invalid number of points: " + line);
+  }
+  if (num_points > MAX_N) {
+    Error("Metric space too large");
+  }
+  if (!reserve(static_cast<int>(num_points))) {
+    return false;
+  }
   for (int i = 0; i < num_points; ++i) {
-    for (int j = i+1; j < num_points; ++j) {
-      if (!stream) {
+    for (int j = i + 1; j < num_points; ++j) {
+      p = end;
+      const int d = strtol(p, &end, 10);
+      if (end == p) {
         Error("Unexpected end of line");
       }
-      stream >> dist[i][j];
-      dist[j][i] = dist[i][j];
+      set(i, j, d);
     }
   }
-  stream >> label;
+  p = end;
+  while (isspace(*p)) {
+    ++p;
+  }
+  const char *label_end = p;
+  while (*label_end != '\0' && !isspace(*label_end)) {
+    ++label_end;
+  }
+  label->assign(p, label_end);
   return true;
 }
 
+/** Parses a metric space from an input line into a distance matrix, with a
+dummy graph for its vertices. **/
+void ParseMetricSpace(const std::string &line, Graph &graph,
+                      DistanceMatrix &distance_matrix, std::string &label) {
+  ParseMetricSpace(
+      line,
+      [&](int num_points) {
+        distance_matrix = DistanceMatrix(num_points);
+        graph = Graph(num_points);
+        return true;
+      },
+      [&](int i, int j, int d) {
+        distance_matrix[i][j] = d;
+        distance_matrix[j][i] = d;
+      },
+      &label);
+}
+
+/** Gets the label at the end of an input line. **/
+std::string GetLabel(const std::string &line) {
+  const size_t end = line.find_last_not_of(" \t\r");
+  if (end == std::string::npos) {
+    return "";
+  }
+  const size_t space = line.find_last_of(" \t", end);
+  const size_t begin = (space == std::string::npos) ? 0 : space + 1;
+  return line.substr(begin, end + 1 - begin);
+}
+
+/** Returns false if a metric space is to be skipped, given its complete
+analysis. **/
+bool IsKept(const AnalysisOptions &options, const MetricSpaceInfo &info) {
+  return !(options.skip_spaces_with_universal_line && info.has_universal_line);
+}
+
+/** Analyzes a metric space that is not in the result cache, if given, and
+records it there under the given key. Returns false if the metric space is to
+be skipped. **/
+bool AnalyzeAndRecord(const int num_vertices, const DistanceMatrixMap &dist,
+                      const AnalysisOptions &options, ResultCache *cache,
+                      const CacheKey &key, MetricSpaceInfo *info) {
+  if (cache == nullptr) {
+    return AnalyzeMetricSpace(num_vertices, dist, options, info);
+  }
+  // Cached results must not depend on -u, so always analyze completely.
+  AnalysisOptions complete_options = options;
+  complete_options.skip_spaces_with_universal_line = false;
+  AnalyzeMetricSpace(num_vertices, dist, complete_options, info);
+  cache->Insert(key, *info);
+  return IsKept(options, *info);
+}
+
+/** Analyzes the metric space on an input line. Returns false if the metric
+space is to be skipped.
+
+If a result cache is given, the analysis is looked up there first. Metric
+spaces labelled by a sparse6-encoded graph, as written by g2dist, are looked up
+by the canonical form of the graph, so that isomorphic graphs share results;
+all other metric spaces are looked up by their distances. The canonical form is
+computed for every line, hit or miss; a hit saves parsing the distances and
+analyzing them. **/
+bool AnalyzeLine(const std::string &line, const AnalysisOptions &options,
+                 ResultCache *cache, std::string *label,
+                 MetricSpaceInfo *info) {
+  CacheKey key;
+  bool is_graph_label = false;
+  if (cache != nullptr) {
+    *label = GetLabel(line);
+    is_graph_label = (label->compare(0, 1, ":") == 0);
+    if (is_graph_label) {
+      key = cache->GraphKey(StringToGraph(*label));
+      if (cache->Lookup(key, info)) {
+        return IsKept(options, *info);
+      }
+    }
+  }
+
+  Graph graph(0);
+  DistanceMatrix distance_matrix(0);
+  ParseMetricSpace(line, graph, distance_matrix, *label);
+  DistanceMatrixMap dist(distance_matrix, graph);
+  const int num_vertices = boost::num_vertices(graph);
+  if (cache != nullptr && !is_graph_label) {
+    key = cache->DistanceMatrixKey(num_vertices, dist);
+    if (cache->Lookup(key, info)) {
+      return IsKept(options, *info);
+    }
+  }
+  return AnalyzeAndRecord(num_vertices, dist, options, cache, key, info);
+}
+
+/** Gets the label of a graph on an input line: the line without surrounding
+whitespace. **/
+std::string GetGraphLabel(const std::string &line) {
+  const size_t begin = line.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  const size_t end = line.find_last_not_of(" \t\r");
+  return line.substr(begin, end + 1 - begin);
+}
+
+/** Analyzes the graph on an input line, in graph6 or sparse6 format, labelled
+by the line itself. Returns false if the metric space is to be skipped.
+
+Graphs are looked up in the result cache, if given, by their canonical form.
+Otherwise, the pre-filters, if given, are tried before computing distances. **/
+bool AnalyzeGraphLine(const std::string &line, const AnalysisOptions &options,
+                      ResultCache *cache, Prefilters *prefilters,
+                      std::string *label, MetricSpaceInfo *info) {
+  *label = GetGraphLabel(line);
+  Graph graph = StringToGraph(*label);
+  CacheKey key;
+  if (cache != nullptr) {
+    key = cache->GraphKey(graph);
+    if (cache->Lookup(key, info)) {
+      return IsKept(options, *info);
+    }
+  }
+  if (prefilters != nullptr && prefilters->Rejects(graph)) {
+    info->has_universal_line = true;
+    return false;
+  }
+
+  auto begin_time = Clock::now();
+  const int num_vertices = boost::num_vertices(graph);
+  DistanceMatrix distance_matrix(num_vertices);
+  GetDistanceMatrix(graph, &distance_matrix);
+  DistanceMatrixMap dist(distance_matrix, graph);
+  const bool valid =
+      AnalyzeAndRecord(num_vertices, dist, options, cache, key, info);
+  if (prefilters != nullptr) {
+    prefilters->RecordAnalysis(1, Clock::now() - begin_time);
+  }
+  return valid;
+}
+
+/** Consecutive metric spaces with the same number of points, collected to be
+analyzed together by AnalyzeMetricSpaces. Metric spaces rejected beforehand
+can be added as well, so that all are passed on in input order. **/
+class MetricSpaceBatch {
+public:
+  explicit MetricSpaceBatch(int capacity) : capacity_(capacity) {}
+
+  /** Adds the metric space on an input line. Returns false, without adding
+  it, if the batch is full or holds metric spaces of another size. **/
+  bool Add(const std::string &line) {
+    std::string label;
+    if (!ParseMetricSpace(
+            line, [this](int num_points) { return Reserve(num_points); },
+            [this](int i, int j, int d) {
+              distances_[(i * num_points_ + j) * capacity_ + size_] = d;
+              distances_[(j * num_points_ + i) * capacity_ + size_] = d;
+            },
+            &label)) {
+      return false;
+    }
+    AddEntry(label, size_++);
+    return true;
+  }
+
+  /** Adds the metric space of a graph. Returns false, without adding it, if
+  the batch is full or holds metric spaces of another size. **/
+  bool AddGraph(const Graph &graph, const std::string &label) {
+    const int num_vertices = boost::num_vertices(graph);
+    if (!Reserve(num_vertices)) {
+      return false;
+    }
+    auto begin_time = Clock::now();
+    DistanceMatrix distance_matrix(num_vertices);
+    GetDistanceMatrix(graph, &distance_matrix);
+    DistanceMatrixMap dist(distance_matrix, graph);
+    for (int i = 0; i < num_vertices; ++i) {
+      for (int j = 0; j < num_vertices; ++j) {
+        distances_[(i * num_vertices + j) * capacity_ + size_] = dist[i][j];
+      }
+    }
+    analysis_time_ += Clock::now() - begin_time;
+    AddEntry(label, size_++);
+    return true;
+  }
+
+  /** Adds a metric space that was rejected because it has a universal line.
+  Returns false, without adding it, if the batch is full. **/
+  bool AddRejected(const std::string &label) {
+    if (labels_.size() >= kMaxEntries) {
+      return false;
+    }
+    AddEntry(label, -1);
+    return true;
+  }
+
+  /** Analyzes the metric spaces in the batch, passes each of them to the
+  given function in input order, and empties the batch. **/
+  template <class F> void Analyze(const AnalysisOptions &options, F process) {
+    MetricSpaceInfo infos[MAX_BATCH_SIZE];
+    bool valid[MAX_BATCH_SIZE];
+    if (size_ > 0) {
+      // Unused lanes hold stale or zero distances; their results are ignored.
+      auto begin_time = Clock::now();
+      AnalyzeMetricSpaces(num_points_, capacity_, distances_.data(), options,
+                          infos, valid);
+      analysis_time_ += Clock::now() - begin_time;
+      num_analyzed_ += size_;
+    }
+    MetricSpaceInfo rejected;
+    rejected.has_universal_line = true;
+    for (size_t e = 0; e < labels_.size(); ++e) {
+      const int lane = lanes_[e];
+      if (lane >= 0) {
+        process(labels_[e], valid[lane], infos[lane]);
+      } else {
+        process(labels_[e], false, rejected);
+      }
+    }
+    labels_.clear();
+    lanes_.clear();
+    size_ = 0;
+  }
+
+  /** Number of metric spaces analyzed, and the time taken to compute the
+  distances of graphs and to analyze. **/
+  unsigned long long num_analyzed() const { return num_analyzed_; }
+  std::chrono::nanoseconds analysis_time() const { return analysis_time_; }
+
+private:
+  // Bounds the number of rejected metric spaces held in a batch.
+  static const size_t kMaxEntries = 1024;
+
+  /** Makes room for a metric space with the given number of points. Returns
+  false if the batch is full or holds metric spaces of another size. **/
+  bool Reserve(int num_points) {
+    if (num_points > MAX_N) {
+      Error("Metric space too large");
+    }
+    if (labels_.size() >= kMaxEntries ||
+        (size_ > 0 && (size_ == capacity_ || num_points != num_points_))) {
+      return false;
+    }
+    if (size_ == 0 && num_points != num_points_) {
+      num_points_ = num_points;
+      distances_.assign(num_points * num_points * capacity_, 0);
+    }
+    return true;
+  }
+
+  void AddEntry(const std::string &label, int lane) {
+    labels_.push_back(label);
+    lanes_.push_back(lane);
+  }
+
+  int capacity_;
+  int size_ = 0;
+  int num_points_ = -1;
+  std::vector<int> distances_;
+  // Label and lane of every metric space, in input order; the lane is -1 for
+  // rejected metric spaces.
+  std::vector<std::string> labels_;
+  std::vector<int> lanes_;
+  unsigned long long num_analyzed_ = 0;
+  std::chrono::nanoseconds analysis_time_{0};
+};
+
 int main(int argc, char *argv[]) {
   ParseCommandLineFlags(argc, argv);
+  SetOutputCompression(FLAGS_gzip);
 
   if (!FLAGS_q) {
     std::cerr << ">A dbe" << std::endl;
   }
 
-  AnalysisOptions options;
-  options.dmin = FLAGS_dmin;
-  options.dmax = FLAGS_dmax;
-  options.dumin = FLAGS_dumin;
-  options.dumax = FLAGS_dumax;
+  AnalysisOptions options = GetAnalysisOptions();
   options.count_bridges = (FLAGS_o == 2);
   options.count_lines_by_distance = (FLAGS_o == 2);
-  options.include_universal_in_lines = FLAGS_p;
-  options.skip_spaces_with_universal_line = FLAGS_u;
-  options.verbose = FLAGS_v;
+  const FilterOptions filter = GetFilterOptions();
+
+  // Analyze each metric space once and test it against every query. The -u
+  // shortcut in the analysis only applies if all queries skip universal lines.
+  std::vector<Query> queries;
+  if (!FLAGS_queries.empty()) {
+    if (FLAGS_coordinator >= 0) {
+      Error("Queries are not supported in coordinator mode");
+    }
+    if (!FLAGS_worker.empty()) {
+      Error("Queries are not supported in worker mode");
+    }
+    queries = ReadQueries(FLAGS_queries);
+    options.skip_spaces_with_universal_line = true;
+    for (const Query &query : queries) {
+      options.skip_spaces_with_universal_line &=
+          query.filter.skip_universal_line;
+    }
+  }
 
   auto begin_time = Clock::now();
+  if (FLAGS_coordinator >= 0) {
+    CoordinatorStats stats =
+        RunCoordinator(FLAGS_coordinator, FLAGS_unit_size, FLAGS_unit_timeout,
+                       FLAGS_grace_period);
+    if (!FLAGS_q) {
+      std::cerr << ">Z dbe coordinator had " << stats.num_workers
+                << " workers analyze " << stats.num_metric_spaces
+                << " metric spaces in " << stats.num_units << " units ("
+                << stats.num_reassigned_units << " reassigned) in "
+                << stats.seconds << " seconds; "
+                << stats.num_output_metric_spaces
+                << " metric spaces output" << std::endl;
+    }
+    gflags::ShutDownCommandLineFlags();
+    return 0;
+  }
+
+  std::unique_ptr<ResultCache> cache;
+  if (!FLAGS_cache.empty()) {
+    cache.reset(new ResultCache(FLAGS_cache, options));
+  }
+
+  std::unique_ptr<Prefilters> prefilters;
+  if (FLAGS_g && FLAGS_prefilters) {
+    prefilters.reset(new Prefilters(options));
+    if (prefilters->empty()) {
+      prefilters.reset();
+    }
+  }
+  // Analyzes the metric space on an input line.
+  auto analyze_line = [&](const std::string &line, std::string *label,
+                          MetricSpaceInfo *info) {
+    if (FLAGS_g) {
+      return AnalyzeGraphLine(line, options, cache.get(), prefilters.get(),
+                              label, info);
+    }
+    return AnalyzeLine(line, options, cache.get(), label, info);
+  };
+
+  if (!FLAGS_worker.empty()) {
+    auto process = [&](const std::vector<std::string> &lines,
+                       std::string *output) {
+      unsigned long long num_output = 0;
+      std::string label;
+      for (const std::string &line : lines) {
+        MetricSpaceInfo info;
+        if (analyze_line(line, &label, &info) &&
+            AcceptMetricSpace(info, filter)) {
+          ++num_output;
+          *output += FormatOutput(info, label);
+        }
+      }
+      return num_output;
+    };
+    unsigned long long num_metric_spaces = RunWorker(FLAGS_worker, process);
+    if (!FLAGS_q) {
+      std::cerr << ">Z dbe worker analyzed " << num_metric_spaces
+                << " metric spaces in "
+                << GetMillisecondsSince(begin_time) / 1000.0 << " seconds"
+                << std::endl;
+      if (prefilters) {
+        prefilters->PrintStatistics(std::cerr);
+      }
+    }
+    cache.reset();
+    gflags::ShutDownCommandLineFlags();
+    return 0;
+  }
+
   unsigned long long num_metric_spaces = 0;
   unsigned long long num_output_metric_spaces = 0;
-  Graph graph(0);
-  DistanceMatrix distance_matrix(0);
-  std::string label;
-  while (ReadMetricSpace(graph, distance_matrix, label)) {
+  // Tests an analyzed metric space against the filter or queries, and writes
+  // it out if it passes.
+  auto process = [&](const std::string &label, bool valid,
+                     const MetricSpaceInfo &info) {
     ++num_metric_spaces;
-    const int num_vertices = boost::num_vertices(graph);
-
-    DistanceMatrixMap dist(distance_matrix, graph);
-    MetricSpaceInfo info;
-    bool valid = AnalyzeMetricSpace(num_vertices, dist, options, &info);
-
     if ((!FLAGS_q) && (num_metric_spaces % 10000000 == 0)) {
       std::cerr << ">Z (in-progress) dbe analyzed " << num_metric_spaces
                 << " metric spaces in " << GetMillisecondsSince(begin_time) / 1000.0
                 << " seconds " << std::endl;
     }
 
+    if (!queries.empty()) {
+      for (Query &query : queries) {
+        if (valid && AcceptMetricSpace(info, query.filter)) {
+          ++query.num_output_metric_spaces;
+          const std::string output = FormatOutput(info, label);
+          if (query.writer) {
+            query.writer->Write(output);
+          } else {
+            WriteOutput(output);
+          }
+        }
+      }
+      return;
+    }
+
     // Determine whether to output this metric space.
-    if (!valid) {
-      continue;
-    } else if (FLAGS_u && info.num_universal > 0) {
-      // Skip because this metric space has a universal line.
-      continue;
-    } else if (FLAGS_n && info.num_lines >= info.num_vertices) {
-      // Skip because this metric space has as many lines as vertices.
-      continue;
-    } else if ((info.amrz_gap < FLAGS_zmin) || (info.amrz_gap > FLAGS_zmax)) {
-      // Skip because this metric space an AMRZ gap outside the requested range.
-      continue;
-    } else if ((info.num_lines < FLAGS_nmin) || (info.num_lines > FLAGS_nmax)) {
-      continue;
+    if (!valid || !AcceptMetricSpace(info, filter)) {
+      return;
     }
 
     ++num_output_metric_spaces;
-    if (FLAGS_o == 0) {
-      if (!FLAGS_q) {
-        std::cerr << "Metric space " << num_metric_spaces << " (output # " << num_output_metric_spaces
-                  << ") has " << info.num_lines
-                  << " lines (from " << info.num_line_pairs << " pairs) and "
-                  << info.num_universal << " mighty pairs (AMRZ gap "
-                  << info.amrz_gap << ")" << std::endl;
+    if ((FLAGS_o == 0) && (!FLAGS_q)) {
+      std::cerr << "Metric space " << num_metric_spaces << " (output # " << num_output_metric_spaces
+                << ") has " << info.num_lines
+                << " lines (from " << info.num_line_pairs << " pairs) and "
+                << info.num_universal << " mighty pairs (AMRZ gap "
+                << info.amrz_gap << ")" << std::endl;
+    }
+    WriteOutput(FormatOutput(info, label));
+  };
+
+  boost::optional<std::string> line;
+  if ((FLAGS_batch_size > 1) && !cache && !FLAGS_v) {
+    if (FLAGS_batch_size > MAX_BATCH_SIZE) {
+      Error("Batch size too large");
+    }
+    MetricSpaceBatch batch(FLAGS_batch_size);
+    while ((line = ReadLine())) {
+      if (!FLAGS_g) {
+        if (!batch.Add(line.get())) {
+          batch.Analyze(options, process);
+          batch.Add(line.get());
+        }
+      } else {
+        std::string label = GetGraphLabel(line.get());
+        Graph graph = StringToGraph(label);
+        if (prefilters && prefilters->Rejects(graph)) {
+          if (!batch.AddRejected(label)) {
+            batch.Analyze(options, process);
+            batch.AddRejected(label);
+          }
+        } else if (!batch.AddGraph(graph, label)) {
+          batch.Analyze(options, process);
+          batch.AddGraph(graph, label);
+        }
       }
-      std::cout << label << std::endl;
-    } else if (FLAGS_o == 1) {
-      std::cout << info.num_lines << "," << info.num_universal << ","
-                << info.amrz_gap << std::endl;
+      // Do not hold results back while waiting for more input.
+      if (!InputLineReady()) {
+        batch.Analyze(options, process);
+      }
+    }
+    batch.Analyze(options, process);
+    if (prefilters) {
+      prefilters->RecordAnalysis(batch.num_analyzed(), batch.analysis_time());
+    }
+  } else {
+    std::string label;
+    while ((line = ReadLine())) {
+      MetricSpaceInfo info;
+      bool valid = analyze_line(line.get(), &label, &info);
+      process(label, valid, info);
+    }
+  }
+
+  for (Query &query : queries) {
+    if (query.writer) {
+      query.writer->Close();
+      close(query.fd);
     }
   }
 
@@ -169,6 +737,18 @@ int main(int argc, char *argv[]) {
     std::cerr << ">Z dbe analyzed " << num_metric_spaces << " metric spaces in "
               << GetMillisecondsSince(begin_time) / 1000.0 << " seconds"
               << std::endl;
+    if (cache) {
+      std::cerr << ">Z dbe found " << cache->num_hits()
+                << " metric spaces in the result cache and analyzed "
+                << cache->num_misses() << std::endl;
+    }
+    for (const Query &query : queries) {
+      std::cerr << ">Z dbe wrote " << query.num_output_metric_spaces
+                << " metric spaces to " << query.path << std::endl;
+    }
+    if (prefilters) {
+      prefilters->PrintStatistics(std::cerr);
+    }
   }
   gflags::ShutDownCommandLineFlags();
   return 0;
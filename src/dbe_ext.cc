@@ -0,0 +1,550 @@
+/** Python bindings for distance matrix calculation and metric space analysis.
+
+Example usage:
+
+    import dbe_ext
+    graphs = ['DUW', 'D~{']
+    distances = dbe_ext.get_distance_matrices(graphs)  # 2 x 5 x 5 int32
+    infos = dbe_ext.analyze_metric_spaces(distances)
+    print(infos[0].num_lines, infos[0].amrz_gap)
+
+Batches are processed on several threads with the GIL released. Distance
+matrices are returned as memoryviews, which numpy.asarray wraps without
+copying; any C-contiguous int32 or int64 buffer of shape (k, n, n) or (n, n)
+is accepted as input.
+**/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/graph/connected_components.hpp>
+
+#include "src/analysis.h"
+#include "src/graphs.h"
+
+namespace {
+
+// Batches smaller than this are not worth splitting across threads.
+const Py_ssize_t kMinItemsPerThread = 256;
+// The analysis adds two distances, which must not overflow.
+const int kMaxDistance = INT_MAX / 2;
+
+PyTypeObject MetricSpaceInfoType;
+
+PyStructSequence_Field metric_space_info_fields[] = {
+    {"num_lines", "Number of distinct lines"},
+    {"num_universal", "Number of pairs that generate the universal line"},
+    {"amrz_gap", "num_lines + num_universal - num_vertices"},
+    {"num_line_pairs", "Number of pairs whose line was counted"},
+    {"has_universal_line", "Whether some pair generates the universal line"},
+    {"num_vertices", "Number of points"},
+    {"num_lines_dist1", "Number of distinct lines generated at distance 1"},
+    {"num_lines_dist2", "Number of distinct lines generated at distance 2"},
+    {"num_universal_dist1", "Number of universal pairs at distance 1"},
+    {"num_universal_dist2", "Number of universal pairs at distance 2"},
+    {nullptr, nullptr}};
+
+PyStructSequence_Desc metric_space_info_desc = {
+    "dbe_ext.MetricSpaceInfo", "Analysis of a metric space.",
+    metric_space_info_fields, 10};
+
+/** Distance matrices computed by get_distance_matrices, exported through the
+buffer protocol as int32 of shape (k, n, n). **/
+struct DistanceMatricesObject {
+  PyObject_HEAD
+  std::vector<int> *values;
+  Py_ssize_t shape[3];
+  Py_ssize_t strides[3];
+};
+
+PyObject *DistanceMatricesType;
+
+void DistanceMatricesDealloc(PyObject *self) {
+  PyTypeObject *type = Py_TYPE(self);
+  delete reinterpret_cast<DistanceMatricesObject *>(self)->values;
+  PyObject_Free(self);
+  Py_DECREF(type);
+}
+
+int DistanceMatricesGetBuffer(PyObject *self, Py_buffer *view, int flags) {
+  DistanceMatricesObject *matrices =
+      reinterpret_cast<DistanceMatricesObject *>(self);
+  static_assert(sizeof(int) == 4, "Distance matrices are exported as int32");
+  view->buf = matrices->values->data();
+  view->obj = self;
+  Py_INCREF(self);
+  view->len = matrices->values->size() * sizeof(int);
+  view->readonly = 0;
+  view->itemsize = sizeof(int);
+  view->format = (flags & PyBUF_FORMAT) ? const_cast<char *>("i") : nullptr;
+  view->ndim = 3;
+  view->shape = (flags & PyBUF_ND) ? matrices->shape : nullptr;
+  view->strides =
+      ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? matrices->strides : nullptr;
+  view->suboffsets = nullptr;
+  view->internal = nullptr;
+  return 0;
+}
+
+PyType_Slot distance_matrices_slots[] = {
+    {Py_tp_dealloc, reinterpret_cast<void *>(DistanceMatricesDealloc)},
+    {Py_bf_getbuffer, reinterpret_cast<void *>(DistanceMatricesGetBuffer)},
+    {0, nullptr}};
+
+PyType_Spec distance_matrices_spec = {
+    "dbe_ext.DistanceMatrices", sizeof(DistanceMatricesObject), 0,
+    Py_TPFLAGS_DEFAULT, distance_matrices_slots};
+
+/** A graph, parsed while holding the GIL. **/
+struct ParsedGraph {
+  int num_vertices;
+  Graph graph{0};
+};
+
+/** Runs process(begin, end) on contiguous ranges of [0, num_items) on up to
+num_threads threads (all hardware threads if 0), with the GIL released. **/
+template <class F>
+void RunInParallel(Py_ssize_t num_items, int num_threads, F process) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = std::min<Py_ssize_t>(
+      num_threads, std::max<Py_ssize_t>(1, num_items / kMinItemsPerThread));
+  Py_BEGIN_ALLOW_THREADS
+  std::vector<std::thread> threads;
+  const Py_ssize_t chunk = (num_items + num_threads - 1) / num_threads;
+  for (int t = 1; t < num_threads; ++t) {
+    const Py_ssize_t begin = std::min(num_items, t * chunk);
+    const Py_ssize_t end = std::min(num_items, begin + chunk);
+    threads.emplace_back(process, begin, end);
+  }
+  process(0, std::min(num_items, chunk));
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  Py_END_ALLOW_THREADS
+}
+
+/** Parses a graph6 or sparse6 string. The string is checked up front, because
+nauty aborts the process on malformed input. Returns false with a Python
+exception set on failure. **/
+bool ParseGraph(PyObject *object, ParsedGraph *parsed) {
+  std::string str;
+  if (PyUnicode_Check(object)) {
+    Py_ssize_t length;
+    const char *data = PyUnicode_AsUTF8AndSize(object, &length);
+    if (data == nullptr) {
+      return false;
+    }
+    str.assign(data, length);
+  } else if (PyBytes_Check(object)) {
+    str.assign(PyBytes_AS_STRING(object), PyBytes_GET_SIZE(object));
+  } else {
+    PyErr_SetString(PyExc_TypeError, "Graphs must be str or bytes");
+    return false;
+  }
+  while (!str.empty() && isspace(str.back())) {
+    str.pop_back();
+  }
+
+  const bool sparse6 = !str.empty() && str[0] == ':';
+  const size_t offset = sparse6 ? 1 : 0;
+  bool valid = str.size() > offset;
+  for (size_t i = offset; valid && i < str.size(); ++i) {
+    valid = (str[i] >= 63) && (str[i] <= 126);
+  }
+  // The size header takes 1, 4 or 8 characters.
+  size_t header = 1;
+  if (valid && str[offset] == 126) {
+    header = (str.size() > offset + 1 && str[offset + 1] == 126) ? 8 : 4;
+  }
+  valid = valid && (str.size() >= offset + header);
+  if (valid && !sparse6) {
+    // The order fits in an int, so the number of bits cannot overflow.
+    const int64_t n = graphsize(const_cast<char *>(str.c_str()));
+    valid = n >= 0 &&
+            str.size() == header + static_cast<size_t>(n * (n - 1) / 2 + 5) / 6;
+  }
+  if (!valid) {
+    PyErr_Format(PyExc_ValueError, "Not a graph6 or sparse6 string: %s",
+                 str.c_str());
+    return false;
+  }
+
+  sparsegraph sg;
+  SG_INIT(sg);
+  int num_loops;
+  stringtosparsegraph(const_cast<char *>(str.c_str()), &sg, &num_loops);
+  if (num_loops != 0) {
+    SG_FREE(sg);
+    PyErr_Format(PyExc_ValueError, "Loops are not supported: %s", str.c_str());
+    return false;
+  }
+  parsed->num_vertices = sg.nv;
+  parsed->graph = SparseGraphToBgl(sg);
+  SG_FREE(sg);
+  return true;
+}
+
+/** Parses a sequence of graphs. Returns false with a Python exception set on
+failure. **/
+bool ParseGraphs(PyObject *graphs, std::vector<ParsedGraph> *parsed) {
+  PyObject *sequence = PySequence_Fast(graphs, "Expected a sequence of graphs");
+  if (sequence == nullptr) {
+    return false;
+  }
+  const Py_ssize_t num_graphs = PySequence_Fast_GET_SIZE(sequence);
+  parsed->resize(num_graphs);
+  for (Py_ssize_t i = 0; i < num_graphs; ++i) {
+    if (!ParseGraph(PySequence_Fast_GET_ITEM(sequence, i), &(*parsed)[i])) {
+      Py_DECREF(sequence);
+      return false;
+    }
+  }
+  Py_DECREF(sequence);
+  return true;
+}
+
+/** Analyzes metric spaces [begin, end) in batches of consecutive metric spaces
+with the same number of points. num_points(i) gives the number of points of
+metric space i, and load(i, distances, stride) stores its distances from
+distances[0] on, with the given stride between entries. **/
+template <class NumPoints, class Load>
+void AnalyzeRange(Py_ssize_t begin, Py_ssize_t end, NumPoints num_points,
+                  Load load, const AnalysisOptions &options,
+                  MetricSpaceInfo *infos) {
+  std::vector<int> distances;
+  bool valid[MAX_BATCH_SIZE];
+  Py_ssize_t i = begin;
+  while (i < end) {
+    const int n = num_points(i);
+    Py_ssize_t batch_end = i + 1;
+    while (batch_end < end && batch_end - i < MAX_BATCH_SIZE &&
+           num_points(batch_end) == n) {
+      ++batch_end;
+    }
+    const int batch_size = batch_end - i;
+    distances.assign(n * n * batch_size, 0);
+    for (int b = 0; b < batch_size; ++b) {
+      load(i + b, distances.data() + b, batch_size);
+    }
+    AnalyzeMetricSpaces(n, batch_size, distances.data(), options, infos + i,
+                        valid);
+    i = batch_end;
+  }
+}
+
+/** Returns whether a graph is connected. **/
+bool IsConnected(const Graph &graph) {
+  std::vector<int> component(boost::num_vertices(graph));
+  return component.empty() ||
+         boost::connected_components(graph, component.data()) == 1;
+}
+
+/** Stores the distances of a graph, with the given stride between entries.
+Vertices in different components are at distance INT_MAX. **/
+void LoadGraphDistances(const ParsedGraph &parsed, int *distances, int stride) {
+  const int n = parsed.num_vertices;
+  DistanceMatrix distance_matrix(n);
+  GetDistanceMatrix(parsed.graph, &distance_matrix);
+  DistanceMatrixMap dist(distance_matrix, parsed.graph);
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      distances[(i * n + j) * stride] = dist[i][j];
+    }
+  }
+}
+
+bool ParseAnalysisOptions(PyObject *kwargs, AnalysisOptions *options,
+                          int *num_threads) {
+  options->dmin = 0;
+  options->dmax = INT_MAX;
+  options->dumin = 0;
+  options->dumax = INT_MAX;
+  *num_threads = 0;
+  if (kwargs == nullptr) {
+    return true;
+  }
+  static const char *keywords[] = {"include_universal_in_lines",
+                                   "count_lines_by_distance",
+                                   "dmin",
+                                   "dmax",
+                                   "dumin",
+                                   "dumax",
+                                   "threads",
+                                   nullptr};
+  int include_universal_in_lines = options->include_universal_in_lines;
+  int count_lines_by_distance = options->count_lines_by_distance;
+  PyObject *no_args = PyTuple_New(0);
+  const bool ok = PyArg_ParseTupleAndKeywords(
+      no_args, kwargs, "|$ppiiiii", const_cast<char **>(keywords),
+      &include_universal_in_lines, &count_lines_by_distance, &options->dmin,
+      &options->dmax, &options->dumin, &options->dumax, num_threads);
+  Py_DECREF(no_args);
+  options->include_universal_in_lines = include_universal_in_lines;
+  options->count_lines_by_distance = count_lines_by_distance;
+  return ok;
+}
+
+PyObject *MakeInfoList(const std::vector<MetricSpaceInfo> &infos) {
+  PyObject *list = PyList_New(infos.size());
+  if (list == nullptr) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < infos.size(); ++i) {
+    const MetricSpaceInfo &info = infos[i];
+    PyObject *item = PyStructSequence_New(&MetricSpaceInfoType);
+    if (item == nullptr) {
+      Py_DECREF(list);
+      return nullptr;
+    }
+    const int values[] = {info.num_lines,         info.num_universal,
+                          info.amrz_gap,          info.num_line_pairs,
+                          info.has_universal_line, info.num_vertices,
+                          info.num_lines_dist1,   info.num_lines_dist2,
+                          info.num_universal_dist1, info.num_universal_dist2};
+    for (int k = 0; k < 10; ++k) {
+      PyStructSequence_SET_ITEM(item, k, k == 4 ? PyBool_FromLong(values[k])
+                                                : PyLong_FromLong(values[k]));
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+  return list;
+}
+
+PyObject *GetDistanceMatrices(PyObject *self, PyObject *args,
+                              PyObject *kwargs) {
+  static const char *keywords[] = {"graphs", "threads", nullptr};
+  PyObject *graphs;
+  int num_threads = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$i",
+                                   const_cast<char **>(keywords), &graphs,
+                                   &num_threads)) {
+    return nullptr;
+  }
+  std::vector<ParsedGraph> parsed;
+  if (!ParseGraphs(graphs, &parsed)) {
+    return nullptr;
+  }
+  const Py_ssize_t num_graphs = parsed.size();
+  const int n = parsed.empty() ? 0 : parsed[0].num_vertices;
+  for (const ParsedGraph &graph : parsed) {
+    if (graph.num_vertices != n) {
+      PyErr_SetString(PyExc_ValueError,
+                      "All graphs must have the same number of vertices");
+      return nullptr;
+    }
+  }
+
+  DistanceMatricesObject *matrices = PyObject_New(
+      DistanceMatricesObject,
+      reinterpret_cast<PyTypeObject *>(DistanceMatricesType));
+  if (matrices == nullptr) {
+    return nullptr;
+  }
+  matrices->values = new std::vector<int>(num_graphs * n * n);
+  matrices->shape[0] = num_graphs;
+  matrices->shape[1] = n;
+  matrices->shape[2] = n;
+  matrices->strides[0] = n * n * sizeof(int);
+  matrices->strides[1] = n * sizeof(int);
+  matrices->strides[2] = sizeof(int);
+  int *distances = matrices->values->data();
+  RunInParallel(num_graphs, num_threads, [&](Py_ssize_t begin, Py_ssize_t end) {
+    for (Py_ssize_t i = begin; i < end; ++i) {
+      LoadGraphDistances(parsed[i], distances + i * n * n, 1);
+    }
+  });
+
+  PyObject *view = PyMemoryView_FromObject(reinterpret_cast<PyObject *>(matrices));
+  Py_DECREF(matrices);
+  return view;
+}
+
+PyObject *AnalyzeMetricSpacesPy(PyObject *self, PyObject *args,
+                                PyObject *kwargs) {
+  PyObject *object;
+  if (!PyArg_ParseTuple(args, "O", &object)) {
+    return nullptr;
+  }
+  AnalysisOptions options;
+  int num_threads;
+  if (!ParseAnalysisOptions(kwargs, &options, &num_threads)) {
+    return nullptr;
+  }
+
+  Py_buffer view;
+  if (PyObject_GetBuffer(object, &view,
+                         PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+    return nullptr;
+  }
+  // Accept native int32 and int64, as produced by numpy and by
+  // get_distance_matrices.
+  const char *format = view.format;
+  if (*format == '@' || *format == '=') {
+    ++format;
+  }
+  const bool format_ok =
+      (strlen(format) == 1) && strchr("ilq", *format) != nullptr &&
+      (view.itemsize == 4 || view.itemsize == 8);
+  if (!format_ok || (view.ndim != 2 && view.ndim != 3) ||
+      view.shape[view.ndim - 1] != view.shape[view.ndim - 2]) {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_ValueError,
+                    "Expected int32 or int64 distance matrices of shape "
+                    "(k, n, n) or (n, n)");
+    return nullptr;
+  }
+  const Py_ssize_t num_spaces = (view.ndim == 3) ? view.shape[0] : 1;
+  const int n = view.shape[view.ndim - 1];
+  if (n > MAX_N) {
+    PyBuffer_Release(&view);
+    PyErr_Format(PyExc_ValueError, "Metric spaces have at most %d points",
+                 MAX_N);
+    return nullptr;
+  }
+
+  std::vector<MetricSpaceInfo> infos(num_spaces);
+  std::vector<char> out_of_range(num_spaces, false);
+  auto load = [&](Py_ssize_t i, int *distances, int stride) {
+    for (int k = 0; k < n * n; ++k) {
+      const Py_ssize_t index = i * n * n + k;
+      int64_t value;
+      if (view.itemsize == 4) {
+        value = static_cast<const int32_t *>(view.buf)[index];
+      } else {
+        value = static_cast<const int64_t *>(view.buf)[index];
+      }
+      if (value < 0 || value > kMaxDistance) {
+        out_of_range[i] = true;
+        value = 0;
+      }
+      distances[k * stride] = static_cast<int>(value);
+    }
+  };
+  RunInParallel(num_spaces, num_threads, [&](Py_ssize_t begin, Py_ssize_t end) {
+    AnalyzeRange(begin, end, [n](Py_ssize_t) { return n; }, load, options,
+                 infos.data());
+  });
+  PyBuffer_Release(&view);
+
+  if (std::find(out_of_range.begin(), out_of_range.end(), true) !=
+      out_of_range.end()) {
+    PyErr_Format(PyExc_ValueError, "Distances must be between 0 and %d",
+                 kMaxDistance);
+    return nullptr;
+  }
+  return MakeInfoList(infos);
+}
+
+PyObject *AnalyzeGraphs(PyObject *self, PyObject *args, PyObject *kwargs) {
+  PyObject *graphs;
+  if (!PyArg_ParseTuple(args, "O", &graphs)) {
+    return nullptr;
+  }
+  AnalysisOptions options;
+  int num_threads;
+  if (!ParseAnalysisOptions(kwargs, &options, &num_threads)) {
+    return nullptr;
+  }
+  std::vector<ParsedGraph> parsed;
+  if (!ParseGraphs(graphs, &parsed)) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < parsed.size(); ++i) {
+    if (parsed[i].num_vertices > MAX_N) {
+      PyErr_Format(PyExc_ValueError, "Graphs have at most %d vertices", MAX_N);
+      return nullptr;
+    }
+    if (!IsConnected(parsed[i].graph)) {
+      PyErr_Format(PyExc_ValueError, "Graph %zu is not connected", i);
+      return nullptr;
+    }
+  }
+
+  std::vector<MetricSpaceInfo> infos(parsed.size());
+  RunInParallel(parsed.size(), num_threads,
+                [&](Py_ssize_t begin, Py_ssize_t end) {
+    AnalyzeRange(
+        begin, end, [&](Py_ssize_t i) { return parsed[i].num_vertices; },
+        [&](Py_ssize_t i, int *distances, int stride) {
+          LoadGraphDistances(parsed[i], distances, stride);
+        },
+        options, infos.data());
+  });
+  return MakeInfoList(infos);
+}
+
+PyMethodDef methods[] = {
+    {"get_distance_matrices",
+     reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(
+         GetDistanceMatrices)),
+     METH_VARARGS | METH_KEYWORDS,
+     "get_distance_matrices(graphs, *, threads=0)\n\n"
+     "Gets the distance matrices of a sequence of graph6 or sparse6 strings,\n"
+     "which must all have the same number of vertices, as an int32 memoryview\n"
+     "of shape (k, n, n). Vertices in different components are at distance\n"
+     "2**31 - 1, which analyze_metric_spaces rejects."},
+    {"analyze_metric_spaces",
+     reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(
+         AnalyzeMetricSpacesPy)),
+     METH_VARARGS | METH_KEYWORDS,
+     "analyze_metric_spaces(distances, *, include_universal_in_lines=True,\n"
+     "                      count_lines_by_distance=False, dmin=0,\n"
+     "                      dmax=2**31-1, dumin=0, dumax=2**31-1, threads=0)\n\n"
+     "Analyzes the lines of metric spaces given as a C-contiguous int32 or\n"
+     "int64 buffer of shape (k, n, n) or (n, n). Distances must be between 0\n"
+     "and 2**30 - 1. Returns a list of MetricSpaceInfo."},
+    {"analyze_graphs",
+     reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(
+         AnalyzeGraphs)),
+     METH_VARARGS | METH_KEYWORDS,
+     "analyze_graphs(graphs, **options)\n\n"
+     "Analyzes the metric spaces of a sequence of graph6 or sparse6 strings,\n"
+     "which may have different numbers of vertices and must be connected.\n"
+     "Takes the same options as analyze_metric_spaces, and returns a list of\n"
+     "MetricSpaceInfo."},
+    {nullptr, nullptr, 0, nullptr}};
+
+PyModuleDef module = {PyModuleDef_HEAD_INIT,
+                      "dbe_ext",
+                      "Distance matrices and line analysis of metric spaces.",
+                      -1,
+                      methods};
+
+}  // namespace
+
+PyMODINIT_FUNC PyInit_dbe_ext() {
+  if (MetricSpaceInfoType.tp_name == nullptr &&
+      PyStructSequence_InitType2(&MetricSpaceInfoType,
+                                 &metric_space_info_desc) != 0) {
+    return nullptr;
+  }
+  if (DistanceMatricesType == nullptr &&
+      (DistanceMatricesType = PyType_FromSpec(&distance_matrices_spec)) ==
+          nullptr) {
+    return nullptr;
+  }
+  PyObject *m = PyModule_Create(&module);
+  if (m == nullptr) {
+    return nullptr;
+  }
+  Py_INCREF(&MetricSpaceInfoType);
+  if (PyModule_AddObject(m, "MetricSpaceInfo",
+                         reinterpret_cast<PyObject *>(&MetricSpaceInfoType)) !=
+      0) {
+    Py_DECREF(&MetricSpaceInfoType);
+    Py_DECREF(m);
+    return nullptr;
+  }
+  return m;
+}
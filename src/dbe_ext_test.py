@@ -0,0 +1,87 @@
+import array
+import unittest
+
+import dbe_ext
+
+ALL_CONNECTED_GRAPHS_ORDER_5 = [
+  'D?{', 'DCw', 'DC{', 'DEw', 'DEk', 'DE{', 'DFw', 'DF{', 'DQo', 'DQw', 'DQ{',
+  'DUW', 'DUw', 'DU{', 'DTw', 'DT{', 'DV{', 'D]w', 'D]{', 'D^{', 'D~{']
+
+
+class DbeExtTest(unittest.TestCase):
+
+  C5='DUW'  # The 5-cycle.
+
+  def testPentagonDistances(self):
+    distances = dbe_ext.get_distance_matrices([self.C5])
+    self.assertEqual(distances.shape, (1, 5, 5))
+    self.assertEqual(distances.tolist()[0], [[0, 2, 1, 1, 2],
+                                             [2, 0, 2, 1, 1],
+                                             [1, 2, 0, 2, 1],
+                                             [1, 1, 2, 0, 2],
+                                             [2, 1, 1, 2, 0]])
+
+  def testPentagon(self):
+    info, = dbe_ext.analyze_graphs([self.C5])
+    # Number of lines, universal pairs, AMRZ gap.
+    self.assertEqual((info.num_lines, info.num_universal, info.amrz_gap),
+                     (10, 0, 5))
+
+  def testNonUniversal(self):
+    infos = dbe_ext.analyze_graphs(ALL_CONNECTED_GRAPHS_ORDER_5)
+    self.assertEqual(sum(not info.has_universal_line for info in infos), 6)
+
+  def testFewerThanNLines(self):
+    infos = dbe_ext.analyze_graphs(ALL_CONNECTED_GRAPHS_ORDER_5)
+    self.assertEqual(sum(info.num_lines < 5 for info in infos), 10)
+
+  def testDistanceMatricesAndGraphsAgree(self):
+    graphs = ALL_CONNECTED_GRAPHS_ORDER_5 * 100
+    distances = dbe_ext.get_distance_matrices(graphs, threads=4)
+    expected = dbe_ext.analyze_graphs(graphs, threads=1)
+    self.assertEqual(dbe_ext.analyze_metric_spaces(distances, threads=4),
+                     expected)
+
+  def testInt64Distances(self):
+    distances = dbe_ext.get_distance_matrices(ALL_CONNECTED_GRAPHS_ORDER_5)
+    values = [d for matrix in distances.tolist() for row in matrix for d in row]
+    int64 = memoryview(array.array('q', values)).cast('B').cast('q', distances.shape)
+    self.assertEqual(dbe_ext.analyze_metric_spaces(int64, dmax=1),
+                     dbe_ext.analyze_metric_spaces(distances, dmax=1))
+
+  def testMixedOrders(self):
+    infos = dbe_ext.analyze_graphs(['Bw', self.C5, 'C~'])
+    self.assertEqual([info.num_vertices for info in infos], [3, 5, 4])
+    with self.assertRaises(ValueError):
+      dbe_ext.get_distance_matrices(['Bw', self.C5])
+
+  def testDisconnected(self):
+    distances = dbe_ext.get_distance_matrices(['A?'])
+    self.assertEqual(distances.tolist(), [[[0, 2**31 - 1], [2**31 - 1, 0]]])
+    with self.assertRaises(ValueError):
+      dbe_ext.analyze_metric_spaces(distances)
+    with self.assertRaises(ValueError):
+      dbe_ext.analyze_graphs([self.C5, 'A?'])
+
+  def testDistanceRange(self):
+    for value in [2**30 - 1, 2**30, -1]:
+      matrix = memoryview(array.array('i', [0, value, value, 0])).cast(
+          'B').cast('i', (2, 2))
+      if value == 2**30 - 1:
+        info, = dbe_ext.analyze_metric_spaces(matrix)
+        self.assertEqual(info.num_lines, 1)
+      else:
+        with self.assertRaises(ValueError):
+          dbe_ext.analyze_metric_spaces(matrix)
+
+  def testInvalidGraphs(self):
+    # The last one claims 2**36 - 1 vertices.
+    for graph in ['D', 'DUWW', ':', 'D\x01W', '~~~~~~~~~~~~~~']:
+      with self.assertRaises(ValueError):
+        dbe_ext.analyze_graphs([graph])
+    with self.assertRaises(TypeError):
+      dbe_ext.analyze_graphs([5])
+
+
+if __name__ == '__main__':
+  unittest.main()
@@ -0,0 +1,53 @@
+#include <climits>
+
+#include "src/dbe_flags.h"
+
+DEFINE_bool(v, false, "Verbose analysis");
+DEFINE_bool(p, true, "Include universal line in line counts");
+DEFINE_bool(n, false, "Do not output metric spaces with |X| lines");
+DEFINE_int32(nmin, 0,
+             "Only output metric spaces with at least this many distinct lines");
+DEFINE_int32(nmax, INT_MAX,
+             "Only output metric spaces with at most this many distinct lines");
+DEFINE_int32(dmin, 0,
+             "Only count lines generated by pairs of vertices at at least this "
+             "distance");
+DEFINE_int32(dmax, INT_MAX,
+             "Only count lines generated by pairs of vertices at at "
+             "most this distance");
+DEFINE_bool(u, false, "Do not output metric spaces with a universal line");
+DEFINE_int32(dumin, 0,
+             "Among pairs that generate the universal line, only count pairs "
+             "at at most this distance");
+DEFINE_int32(dumax, INT_MAX,
+             "Among pairs that generate the universal line, only count pairs "
+             "at at least this distance");
+DEFINE_int32(zmin, INT_MIN,
+             "Only output metric spaces with a AMRZ gap of at least this number");
+DEFINE_int32(zmax, INT_MAX,
+             "Only output metric spaces with a AMRZ gap of at most this number");
+
+/** Gets the analysis options specified on the command line. **/
+AnalysisOptions GetAnalysisOptions() {
+  AnalysisOptions options;
+  options.dmin = FLAGS_dmin;
+  options.dmax = FLAGS_dmax;
+  options.dumin = FLAGS_dumin;
+  options.dumax = FLAGS_dumax;
+  options.include_universal_in_lines = FLAGS_p;
+  options.skip_spaces_with_universal_line = FLAGS_u;
+  options.verbose = FLAGS_v;
+  return options;
+}
+
+/** Gets the metric space filter specified on the command line. **/
+FilterOptions GetFilterOptions() {
+  FilterOptions filter;
+  filter.skip_universal_line = FLAGS_u;
+  filter.skip_n_lines = FLAGS_n;
+  filter.nmin = FLAGS_nmin;
+  filter.nmax = FLAGS_nmax;
+  filter.zmin = FLAGS_zmin;
+  filter.zmax = FLAGS_zmax;
+  return filter;
+}
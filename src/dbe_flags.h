@@ -0,0 +1,27 @@
+#ifndef __DBE_FLAGS_H__
+#define __DBE_FLAGS_H__
+
+#include <gflags/gflags.h>
+
+#include "src/analysis.h"
+
+DECLARE_bool(v);
+DECLARE_bool(p);
+DECLARE_bool(n);
+DECLARE_int32(nmin);
+DECLARE_int32(nmax);
+DECLARE_int32(dmin);
+DECLARE_int32(dmax);
+DECLARE_bool(u);
+DECLARE_int32(dumin);
+DECLARE_int32(dumax);
+DECLARE_int32(zmin);
+DECLARE_int32(zmax);
+
+/** Gets the analysis options specified on the command line. **/
+AnalysisOptions GetAnalysisOptions();
+
+/** Gets the metric space filter specified on the command line. **/
+FilterOptions GetFilterOptions();
+
+#endif
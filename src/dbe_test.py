@@ -1,31 +1,88 @@
+import gzip
+import itertools
+import os
+import re
+import select
+import shutil
+import signal
+import socket
+import struct
 import subprocess
+import tempfile
+import time
 import unittest
+import zlib
+
+# Magic number of messages between a dbe coordinator and its workers.
+MAGIC = 0x6462652d756e6974
 
 ALL_CONNECTED_GRAPHS_ORDER_5 = [
   'D?{', 'DCw', 'DC{', 'DEw', 'DEk', 'DE{', 'DFw', 'DF{', 'DQo', 'DQw', 'DQ{',
   'DUW', 'DUw', 'DU{', 'DTw', 'DT{', 'DV{', 'D]w', 'D]{', 'D^{', 'D~{']
 
 
-def RunDbe(input, args=()):
+def Graph6(n, edges):
+  """Encodes a graph of order at most 62 in graph6 format."""
+  bits = [int((i, j) in edges) for j in range(n) for i in range(j)]
+  bits += [0] * (-len(bits) % 6)
+  return chr(63 + n) + ''.join(
+      chr(63 + int(''.join(map(str, bits[k:k + 6])), 2))
+      for k in range(0, len(bits), 6))
+
+
+def AllConnectedGraphs(max_order):
+  """Generates all labelled connected graphs up to the given order in graph6
+  format."""
+  for n in range(1, max_order + 1):
+    pairs = list(itertools.combinations(range(n), 2))
+    for mask in range(1 << len(pairs)):
+      edges = set(pair for k, pair in enumerate(pairs) if mask & (1 << k))
+      reached = set([0])
+      while True:
+        new = set(v for u, v in edges if u in reached) | set(
+            u for u, v in edges if v in reached)
+        if new <= reached:
+          break
+        reached |= new
+      if len(reached) == n:
+        yield Graph6(n, edges)
+
+
+def Run(binary, input, args=()):
+  """Runs a binary with the given arguments on the given input, which is
+  either a string to pipe in or a file to use as stdin. Returns its stdout and
+  stderr."""
   if not isinstance(args, (tuple, list)):
     args = [args]
   if isinstance(input, (tuple, list)):
     input = '\n'.join(input)
-
-  process = subprocess.Popen(['g2dist'],
-      stdin=subprocess.PIPE,
+  piped = isinstance(input, str)
+  process = subprocess.Popen([binary] + list(args),
+      stdin=subprocess.PIPE if piped else input,
       stderr=subprocess.PIPE,
       stdout=subprocess.PIPE)
-  dists, stderr = process.communicate(input=input)
+  return process.communicate(input=input if piped else None)
 
-  process = subprocess.Popen(['dbe'] + list(args),
-      stdin=subprocess.PIPE,
-      stderr=subprocess.PIPE,
-      stdout=subprocess.PIPE)
-  stdout, stderr = process.communicate(input=dists)
-  stdout = [line for line in stdout.split('\n') if line]
-  stderr = [line for line in stderr.split('\n') if line]
-  return stdout, stderr
+
+def Lines(output):
+  return [line for line in output.split('\n') if line]
+
+
+def FreePort():
+  """Gets a TCP port that is currently free."""
+  s = socket.socket()
+  s.bind(('localhost', 0))
+  port = s.getsockname()[1]
+  s.close()
+  return port
+
+
+def RunDbe(input, args=()):
+  """Runs dbe on the distances of the given graphs. Returns its output and
+  error lines."""
+  dists, _ = Run('g2dist', input)
+  stdout, stderr = Run('dbe', dists, args)
+  return Lines(stdout), Lines(stderr)
 
 
 class DbeTest(unittest.TestCase):
@@ -58,6 +115,378 @@ class DbeTest(unittest.TestCase):
     stdout, stderr = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, '-nmin=0')
     self.assertEqual(len(set(stdout)), len(ALL_CONNECTED_GRAPHS_ORDER_5))
 
+  def testBatchSizes(self):
+    # Mix orders so that batches are cut short whenever the order changes.
+    graphs = ALL_CONNECTED_GRAPHS_ORDER_5 + ['C~', 'Bw'] + ALL_CONNECTED_GRAPHS_ORDER_5[:3]
+    for args in (['-o=1'], ['-u']):
+      expected, _ = RunDbe(graphs, args + ['--batch_size=1'])
+      for batch_size in (2, 7, 32):
+        stdout, _ = RunDbe(graphs, args + ['--batch_size=%d' % batch_size])
+        self.assertEqual(stdout, expected)
+
+  def testGraphInput(self):
+    expected, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, '-o=1')
+    stdout, _ = Run('dbe', ALL_CONNECTED_GRAPHS_ORDER_5, ['-g', '-o=1'])
+    self.assertEqual(Lines(stdout), expected)
+
+  def testPrefiltersAreSound(self):
+    # A pre-filter may only reject graphs whose metric space has a universal
+    # line, so -u must give the same output with and without pre-filters.
+    graphs = '\n'.join(AllConnectedGraphs(6))
+    outputs = {}
+    for args in (['--prefilters=false'], [], ['--batch_size=1']):
+      stdout, stderr = Run('dbe', graphs, ['-g', '-u'] + args)
+      outputs[tuple(args)] = stdout
+      if args != ['--prefilters=false']:
+        for prefilter in ('pendant_vertex', 'bridge'):
+          match = re.search(r'>Z dbe pre-filter %s rejected (\d+) of (\d+) '
+                            r'graphs' % prefilter, stderr)
+          self.assertTrue(match, 'No summary of pre-filter ' + prefilter)
+          self.assertGreater(int(match.group(1)), 0)
+    self.assertTrue(outputs[('--prefilters=false',)])
+    self.assertEqual(outputs[()], outputs[('--prefilters=false',)])
+    self.assertEqual(outputs[('--batch_size=1',)], outputs[('--prefilters=false',)])
+
+  def testMalformedInput(self):
+    for args in [[], ['--batch_size=1']]:
+      _, stderr = Run('dbe', '100000 1 2 3 :x\n', args)
+      self.assertEqual(Lines(stderr)[-1], 'ERROR: Metric space too large')
+      _, stderr = Run('dbe', 'x 1 2 3 :x\n', args)
+      self.assertEqual(Lines(stderr)[-1],
+                       'ERROR: Invalid number of points: x 1 2 3 :x')
+      _, stderr = Run('dbe', Graph6(15, set()), ['-g'] + args)
+      self.assertEqual(Lines(stderr)[-1], 'ERROR: Metric space too large')
+
+  def testCache(self):
+    tmpdir = tempfile.mkdtemp()
+    try:
+      cache = '--cache=' + os.path.join(tmpdir, 'cache')
+      for args in (['-u'], ['-n'], ['-nmax=3'], ['-u'], ['-dumin=2', '-u']):
+        expected, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, args)
+        stdout, stderr = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, args + [cache])
+        self.assertEqual(stdout, expected)
+    finally:
+      shutil.rmtree(tmpdir)
+
+  def testCacheSharesIsomorphicGraphs(self):
+    tmpdir = tempfile.mkdtemp()
+    try:
+      cache = '--cache=' + os.path.join(tmpdir, 'cache')
+      RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, ['-u', cache])
+      # Every labelled connected graph of order 5 is isomorphic to one of the
+      # graphs analyzed before.
+      graphs = [g for g in AllConnectedGraphs(5) if g[0] == 'D']
+      expected, _ = RunDbe(graphs, '-u')
+      stdout, stderr = RunDbe(graphs, ['-u', cache])
+      self.assertEqual(stdout, expected)
+      self.assertIn('>Z dbe found %d metric spaces in the result cache and '
+                    'analyzed 0' % len(graphs), stderr)
+    finally:
+      shutil.rmtree(tmpdir)
+
+  def testCacheRecordsEachAnalysisOnce(self):
+    tmpdir = tempfile.mkdtemp()
+    try:
+      path = os.path.join(tmpdir, 'cache')
+      dists, _ = Run('g2dist', ALL_CONNECTED_GRAPHS_ORDER_5)
+      processes = [subprocess.Popen(['dbe', '-u', '--cache=' + path],
+          stdin=subprocess.PIPE,
+          stderr=subprocess.PIPE,
+          stdout=subprocess.PIPE) for _ in range(4)]
+      for process in processes:
+        process.communicate(input=dists)
+      # A 16-byte header and a 64-byte record per metric space.
+      size = 16 + 64 * len(ALL_CONNECTED_GRAPHS_ORDER_5)
+      self.assertEqual(os.path.getsize(path), size)
+      RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, ['-n', '--cache=' + path])
+      self.assertEqual(os.path.getsize(path), size)
+    finally:
+      shutil.rmtree(tmpdir)
+
+  def testQueries(self):
+    tmpdir = tempfile.mkdtemp()
+    try:
+      queries = [['-u'], ['-n'], ['-nmax=3'], ['-zmax=0', '-nmin=5']]
+      query_file = os.path.join(tmpdir, 'queries')
+      with open(query_file, 'w') as f:
+        for i, args in enumerate(queries):
+          f.write('%s %s\n' % (os.path.join(tmpdir, str(i)), ' '.join(args)))
+      stdout, stderr = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5,
+                              '--queries=' + query_file)
+      self.assertEqual(stdout, [])
+      for i, args in enumerate(queries):
+        expected, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, args)
+        with open(os.path.join(tmpdir, str(i))) as f:
+          self.assertEqual(f.read().split(), expected)
+    finally:
+      shutil.rmtree(tmpdir)
+
+  def testQueryFlags(self):
+    tmpdir = tempfile.mkdtemp()
+    try:
+      query_file = os.path.join(tmpdir, 'queries')
+      equivalent = [(['-u=false', '-n=no'], []), (['-u=true'], ['-u']),
+                    (['--nmin=5'], ['-nmin=5']), (['-nmin', '5'], ['-nmin=5']),
+                    (['--zmax', '0', '-nmin=5'], ['-zmax=0', '-nmin=5'])]
+      for flags, args in equivalent:
+        with open(query_file, 'w') as f:
+          f.write('- %s\n' % ' '.join(flags))
+        stdout, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5,
+                           '--queries=' + query_file)
+        expected, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, args)
+        self.assertEqual(stdout, expected)
+    finally:
+      shutil.rmtree(tmpdir)
+
+  def testInvalidQueries(self):
+    tmpdir = tempfile.mkdtemp()
+    try:
+      output = os.path.join(tmpdir, 'output')
+      query_file = os.path.join(tmpdir, 'queries')
+      invalid = [
+          ('%s -nmin' % output, 'Missing value for query flag -nmin'),
+          ('%s -nmin=x' % output, 'Invalid value for query flag -nmin: x'),
+          ('%s -nmax=' % output, 'Invalid value for query flag -nmax: '),
+          ('%s -u=maybe' % output, 'Invalid value for query flag -u: maybe'),
+          ('%s -q' % output, 'Invalid query flag: -q'),
+          ('%s -u\n%s -n' % (output, output),
+           'Duplicate query output ' + output),
+          ('%s -u\n%s/./output -n' % (output, tmpdir),
+           'Duplicate query output %s/./output' % tmpdir),
+          ('- -u\n- -n', 'Duplicate query output -')]
+      for queries, error in invalid:
+        with open(query_file, 'w') as f:
+          f.write(queries + '\n')
+        stdout, stderr = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5,
+                                '--queries=' + query_file)
+        self.assertEqual(stderr[-1], 'ERROR: ' + error)
+      stdout, stderr = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5,
+                              ['--queries=' + query_file, '--coordinator=0'])
+      self.assertEqual(stderr[-1],
+                       'ERROR: Queries are not supported in coordinator mode')
+    finally:
+      shutil.rmtree(tmpdir)
+
+  def testCompressedStreams(self):
+    expected, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, '-u')
+    dists, _ = Run('g2dist', ALL_CONNECTED_GRAPHS_ORDER_5, '--gzip')
+    self.assertEqual(dists[:2], '\x1f\x8b')
+    stdout, _ = Run('dbe', dists, ['-u', '--gzip'])
+    stdout = zlib.decompress(stdout, 16 + zlib.MAX_WBITS)
+    self.assertEqual(Lines(stdout), expected)
+
+  def StartDbe(self, args):
+    """Starts dbe on the distances of the connected graphs of order 5, and
+    leaves its input open."""
+    dists, _ = Run('g2dist', ALL_CONNECTED_GRAPHS_ORDER_5)
+    process = subprocess.Popen(['dbe', '-q'] + args,
+        stdin=subprocess.PIPE,
+        stdout=subprocess.PIPE)
+    process.stdin.write(dists)
+    process.stdin.flush()
+    return process
+
+  def testOutputIsNotHeldBack(self):
+    expected, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, '-u')
+    for args in [['-u'], ['-u', '--gzip']]:
+      process = self.StartDbe(args)
+      decompressor = zlib.decompressobj(16 + zlib.MAX_WBITS)
+      output = ''
+      deadline = time.time() + 10
+      while len(Lines(output)) < len(expected) and time.time() < deadline:
+        if select.select([process.stdout], [], [], 0.1)[0]:
+          data = os.read(process.stdout.fileno(), 1 << 16)
+          output += decompressor.decompress(data) if '--gzip' in args else data
+      self.assertEqual(Lines(output), expected)
+      process.stdin.close()
+      self.assertEqual(process.wait(), 0)
+
+  def testInterruptWritesOutOutput(self):
+    expected, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, '-u')
+    process = self.StartDbe(['-u', '--gzip'])
+    time.sleep(0.5)
+    process.send_signal(signal.SIGTERM)
+    stdout = process.stdout.read()
+    self.assertEqual(process.wait(), -signal.SIGTERM)
+    # The output is a complete gzip stream.
+    stdout = zlib.decompress(stdout, 16 + zlib.MAX_WBITS)
+    self.assertEqual(Lines(stdout), expected)
+
+  def StartCoordinator(self, input, args=(), port=None):
+    """Starts a coordinator on the distances of the given graphs, and waits
+    until it listens. Returns the process and its port."""
+    dists, _ = Run('g2dist', input)
+    if port is None:
+      port = FreePort()
+    coordinator = subprocess.Popen(
+        ['dbe', '--coordinator=%d' % port, '--unit_size=4',
+         '--grace_period=2'] + list(args),
+        stdin=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        stdout=subprocess.PIPE)
+    coordinator.stdin.write(dists)
+    coordinator.stdin.close()
+    for _ in range(50):
+      try:
+        socket.create_connection(('localhost', port)).close()
+        break
+      except socket.error:
+        time.sleep(0.1)
+    return coordinator, port
+
+  def StartWorker(self, port):
+    return subprocess.Popen(
+        ['dbe', '-u', '--worker=localhost:%d' % port],
+        stderr=subprocess.PIPE,
+        stdout=subprocess.PIPE)
+
+  def FinishWorker(self, worker):
+    """Waits for a worker to finish, and returns the number of metric spaces
+    that it analyzed."""
+    _, stderr = worker.communicate()
+    self.assertEqual(worker.returncode, 0, stderr)
+    return int(re.match(r'>Z dbe worker analyzed (\d+) ',
+                        Lines(stderr)[-1]).group(1))
+
+  def FinishCoordinator(self, coordinator, port, num_workers):
+    """Runs workers until the coordinator is done, and returns its output and
+    error lines."""
+    workers = [self.StartWorker(port) for _ in range(num_workers)]
+    for worker in workers:
+      self.FinishWorker(worker)
+    stdout = coordinator.stdout.read()
+    stderr = coordinator.stderr.read()
+    self.assertEqual(coordinator.wait(), 0)
+    return Lines(stdout), Lines(stderr)
+
+  def testCoordinator(self):
+    expected, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, '-u')
+    coordinator, port = self.StartCoordinator(ALL_CONNECTED_GRAPHS_ORDER_5)
+    stdout, stderr = self.FinishCoordinator(coordinator, port, 2)
+    self.assertEqual(sorted(stdout), sorted(expected))
+    self.assertIn('>Z dbe coordinator had 2 workers analyze 21 metric spaces',
+                  stderr[-1])
+
+  def testCoordinatorDropsStrayConnections(self):
+    expected, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, '-u')
+    coordinator, port = self.StartCoordinator(ALL_CONNECTED_GRAPHS_ORDER_5)
+    http = socket.create_connection(('localhost', port))
+    http.sendall('GET / HTTP/1.1\r\nHost: localhost\r\n'
+                 'User-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n')
+    huge = socket.create_connection(('localhost', port))
+    huge.sendall(struct.pack('>7Q', MAGIC, 1, 1, 0, 0, 0, 1 << 40))
+    self.assertEqual(http.recv(1), '')
+    self.assertEqual(huge.recv(1), '')
+    stdout, stderr = self.FinishCoordinator(coordinator, port, 2)
+    self.assertEqual(sorted(stdout), sorted(expected))
+    # Neither these connections nor port probes count as workers.
+    self.assertIn('>Z dbe coordinator had 2 workers', stderr[-1])
+
+  def testCoordinatorTellsLateWorkersThatWorkIsDone(self):
+    coordinator, port = self.StartCoordinator(ALL_CONNECTED_GRAPHS_ORDER_5,
+                                              ['--grace_period=5'])
+    self.assertEqual(self.FinishWorker(self.StartWorker(port)), 21)
+    self.assertEqual(self.FinishWorker(self.StartWorker(port)), 0)
+    _, stderr = self.FinishCoordinator(coordinator, port, 0)
+    self.assertIn('>Z dbe coordinator had 2 workers', stderr[-1])
+
+  def testWorkerWaitsForCoordinator(self):
+    expected, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, '-u')
+    port = FreePort()
+    worker = self.StartWorker(port)
+    time.sleep(1)
+    coordinator, _ = self.StartCoordinator(ALL_CONNECTED_GRAPHS_ORDER_5,
+                                           port=port)
+    self.assertEqual(self.FinishWorker(worker), 21)
+    stdout, _ = self.FinishCoordinator(coordinator, port, 0)
+    self.assertEqual(sorted(stdout), sorted(expected))
+
+  def testCoordinatorReassignsStuckUnits(self):
+    expected, _ = RunDbe(ALL_CONNECTED_GRAPHS_ORDER_5, '-u')
+    coordinator, port = self.StartCoordinator(ALL_CONNECTED_GRAPHS_ORDER_5,
+                                              ['--unit_timeout=1'])
+    # A worker that takes a unit, and stops halfway through its result.
+    stuck = socket.create_connection(('localhost', port))
+    stuck.sendall(struct.pack('>7Q', MAGIC, 1, 1, 0, 0, 0, 0))
+    header = ''
+    while len(header) < 56:
+      header += stuck.recv(56 - len(header))
+    self.assertEqual(struct.unpack('>7Q', header)[2], 2)
+    stuck.sendall(struct.pack('>7Q', MAGIC, 1, 3, 0, 0, 0, 0)[:20])
+    stdout, stderr = self.FinishCoordinator(coordinator, port, 1)
+    stuck.close()
+    self.assertEqual(sorted(stdout), sorted(expected))
+    self.assertIn('>E dbe coordinator timed out waiting for a worker', stderr)
+    self.assertIn('(1 reassigned)', stderr[-1])
+
+class InputTest(unittest.TestCase):
+  """Tests reading stdin from a pipe, from a regular file, which is memory
+  mapped, and from a compressed file."""
+
+  def setUp(self):
+    self.tmpdir = tempfile.mkdtemp()
+
+  def tearDown(self):
+    shutil.rmtree(self.tmpdir)
+
+  def ReadLines(self, input):
+    """Runs g2dist on input through a pipe, a regular file and a gzip file,
+    checks that the outputs agree, and returns the output lines."""
+    stdout, _ = Run('g2dist', input, '-q')
+    path = os.path.join(self.tmpdir, 'input')
+    with open(path, 'wb') as f:
+      f.write(input)
+    with open(path, 'rb') as f:
+      self.assertEqual(Run('g2dist', f, '-q')[0], stdout)
+    f = gzip.open(path, 'wb')
+    f.write(input)
+    f.close()
+    with open(path, 'rb') as f:
+      self.assertEqual(Run('g2dist', f, '-q')[0], stdout)
+    return Lines(stdout)
+
+  def testBlankLines(self):
+    expected = self.ReadLines('\n'.join(ALL_CONNECTED_GRAPHS_ORDER_5) + '\n')
+    self.assertEqual(len(expected), len(ALL_CONNECTED_GRAPHS_ORDER_5))
+    input = '\n\n' + '\n\n\n'.join(ALL_CONNECTED_GRAPHS_ORDER_5) + '\n\n'
+    self.assertEqual(self.ReadLines(input), expected)
+
+  def testMissingFinalNewline(self):
+    expected = self.ReadLines('\n'.join(ALL_CONNECTED_GRAPHS_ORDER_5) + '\n')
+    self.assertEqual(
+        self.ReadLines('\n'.join(ALL_CONNECTED_GRAPHS_ORDER_5)), expected)
+
+  def testLinesAcrossBlocks(self):
+    # Input is read in blocks of 1 MiB; the lines have 3 or 4 characters, and
+    # the leading blank lines shift them, so that some block ends inside a
+    # line, and some right after one.
+    expected = self.ReadLines('\n'.join(ALL_CONNECTED_GRAPHS_ORDER_5))
+    body = '\n'.join(ALL_CONNECTED_GRAPHS_ORDER_5 * 15000)
+    self.assertGreater(len(body), 1 << 20)
+    for shift in range(4):
+      stdout = self.ReadLines('\n' * shift + body)
+      self.assertEqual(stdout, expected * 15000)
+
+  def testGzipMagicSplitAcrossReads(self):
+    input = '\n'.join(ALL_CONNECTED_GRAPHS_ORDER_5)
+    expected = self.ReadLines(input)
+    path = os.path.join(self.tmpdir, 'input.gz')
+    f = gzip.open(path, 'wb')
+    f.write(input)
+    f.close()
+    with open(path, 'rb') as f:
+      compressed = f.read()
+    # Deliver the first byte of the gzip magic number on its own.
+    process = subprocess.Popen(['g2dist', '-q'],
+        stdin=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        stdout=subprocess.PIPE)
+    process.stdin.write(compressed[0])
+    process.stdin.flush()
+    time.sleep(0.2)
+    stdout, _ = process.communicate(input=compressed[1:])
+    self.assertEqual(Lines(stdout), expected)
+
 
 if __name__ == '__main__':
     unittest.main()
\ No newline at end of file
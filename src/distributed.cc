@@ -0,0 +1,556 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <thread>
+
+#include <endian.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "src/common.h"
+#include "src/distributed.h"
+#include "src/io.h"
+
+namespace {
+
+typedef std::chrono::steady_clock SteadyClock;
+
+// Messages consist of seven 64-bit big-endian header fields (magic number,
+// protocol version, type, unit id, number of metric spaces, number of output
+// metric spaces and payload length), followed by the payload.
+const uint64_t kMagic = 0x6462652d756e6974ULL;  // "dbe-unit"
+const uint64_t kVersion = 1;
+const size_t kHeaderSize = 7 * sizeof(uint64_t);
+// Far more than any unit or its output, but small enough to allocate.
+const uint64_t kMaxPayloadSize = 1ULL << 30;
+const size_t kReceiveBlockSize = 1 << 16;
+// A worker asks for work as soon as it connects.
+const std::chrono::seconds kRequestTimeout(10);
+// How long a worker keeps trying to reach a coordinator that is not listening
+// yet, as when both are started at the same time.
+const std::chrono::seconds kConnectTimeout(10);
+const std::chrono::milliseconds kConnectRetryInterval(100);
+
+const uint64_t REQUEST = 1;  // Worker asks for its first unit.
+const uint64_t UNIT = 2;     // Coordinator hands out a unit of input lines.
+const uint64_t RESULT = 3;   // Worker returns its output and asks for more.
+const uint64_t DONE = 4;     // Coordinator reports that all work is done.
+
+struct Message {
+  uint64_t type = 0;
+  uint64_t unit_id = 0;
+  uint64_t num_metric_spaces = 0;
+  uint64_t num_output_metric_spaces = 0;
+  std::string payload;
+};
+
+struct WorkUnit {
+  uint64_t id = 0;
+  uint64_t num_metric_spaces = 0;
+  std::string payload;
+};
+
+/** A worker as seen by the coordinator. Its socket is non-blocking: bytes are
+collected in input until a message is complete, and bytes that the socket
+does not take at once wait in output. **/
+struct Connection {
+  int fd = -1;
+  bool has_unit = false;
+  bool waiting = false;
+  bool closing = false;
+  WorkUnit unit;
+  std::string input;
+  std::string output;
+  size_t output_offset = 0;
+  // When the worker has to have sent its next message.
+  SteadyClock::time_point deadline = SteadyClock::time_point::max();
+};
+
+std::string EncodeMessage(uint64_t type, uint64_t unit_id,
+                          uint64_t num_metric_spaces,
+                          uint64_t num_output_metric_spaces,
+                          const std::string &payload) {
+  const uint64_t header[7] = {htobe64(kMagic),
+                              htobe64(kVersion),
+                              htobe64(type),
+                              htobe64(unit_id),
+                              htobe64(num_metric_spaces),
+                              htobe64(num_output_metric_spaces),
+                              htobe64(payload.size())};
+  std::string message(reinterpret_cast<const char *>(header), kHeaderSize);
+  message += payload;
+  return message;
+}
+
+/** Decodes a message header into message and payload_size. Returns false if
+the header is not from a peer that speaks this protocol. **/
+bool DecodeHeader(const char *data, Message *message, uint64_t *payload_size) {
+  uint64_t header[7];
+  memcpy(header, data, kHeaderSize);
+  if (be64toh(header[0]) != kMagic || be64toh(header[1]) != kVersion) {
+    return false;
+  }
+  message->type = be64toh(header[2]);
+  message->unit_id = be64toh(header[3]);
+  message->num_metric_spaces = be64toh(header[4]);
+  message->num_output_metric_spaces = be64toh(header[5]);
+  *payload_size = be64toh(header[6]);
+  return *payload_size <= kMaxPayloadSize;
+}
+
+bool SendAll(int fd, const void *data, size_t length) {
+  const char *p = static_cast<const char *>(data);
+  while (length > 0) {
+    ssize_t num_sent = send(fd, p, length, MSG_NOSIGNAL);
+    if (num_sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += num_sent;
+    length -= num_sent;
+  }
+  return true;
+}
+
+bool ReceiveAll(int fd, void *data, size_t length) {
+  char *p = static_cast<char *>(data);
+  while (length > 0) {
+    ssize_t num_received = recv(fd, p, length, 0);
+    if (num_received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (num_received <= 0) {
+      return false;
+    }
+    p += num_received;
+    length -= num_received;
+  }
+  return true;
+}
+
+/** Sends a message over a blocking socket. **/
+bool SendMessage(int fd, uint64_t type, uint64_t unit_id,
+                 uint64_t num_metric_spaces,
+                 uint64_t num_output_metric_spaces,
+                 const std::string &payload) {
+  const std::string message = EncodeMessage(
+      type, unit_id, num_metric_spaces, num_output_metric_spaces, payload);
+  return SendAll(fd, message.data(), message.size());
+}
+
+/** Receives a message over a blocking socket. Aborts if the peer does not
+speak this protocol. **/
+bool ReceiveMessage(int fd, Message *message) {
+  char header[kHeaderSize];
+  if (!ReceiveAll(fd, header, sizeof(header))) {
+    return false;
+  }
+  uint64_t payload_size;
+  if (!DecodeHeader(header, message, &payload_size)) {
+    Error("Invalid message from coordinator");
+  }
+  message->payload.resize(payload_size);
+  return ReceiveAll(fd, &message->payload[0], message->payload.size());
+}
+
+/** Receives what is available on a non-blocking socket. Returns false if the
+connection is closed or broken. **/
+bool ReceiveAvailable(Connection &connection) {
+  char buffer[kReceiveBlockSize];
+  while (true) {
+    ssize_t num_received =
+        recv(connection.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (num_received > 0) {
+      connection.input.append(buffer, num_received);
+      continue;
+    }
+    if (num_received < 0 && errno == EINTR) {
+      continue;
+    }
+    return num_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+}
+
+/** Takes the first complete message out of a connection's input. Returns
+false if there is none yet; sets invalid if the input is not a message. **/
+bool TakeMessage(Connection &connection, Message *message, bool *invalid) {
+  *invalid = false;
+  if (connection.input.size() < kHeaderSize) {
+    return false;
+  }
+  uint64_t payload_size;
+  if (!DecodeHeader(connection.input.data(), message, &payload_size)) {
+    *invalid = true;
+    return false;
+  }
+  if (connection.input.size() - kHeaderSize < payload_size) {
+    return false;
+  }
+  message->payload.assign(connection.input, kHeaderSize, payload_size);
+  connection.input.erase(0, kHeaderSize + payload_size);
+  return true;
+}
+
+/** Sends as much of a connection's output as its socket takes. Returns false
+if the connection is broken. **/
+bool SendAvailable(Connection &connection) {
+  while (connection.output_offset < connection.output.size()) {
+    ssize_t num_sent =
+        send(connection.fd, connection.output.data() + connection.output_offset,
+             connection.output.size() - connection.output_offset,
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (num_sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    connection.output_offset += num_sent;
+  }
+  connection.output.clear();
+  connection.output_offset = 0;
+  return true;
+}
+
+/** Enables TCP keepalive with short intervals, so that a peer whose host dies
+is noticed within minutes rather than the default two hours. **/
+void ConfigureSocket(int fd) {
+  const int enable = 1;
+  const int idle_seconds = 60;
+  const int interval_seconds = 10;
+  const int num_probes = 6;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle_seconds,
+             sizeof(idle_seconds));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval_seconds,
+             sizeof(interval_seconds));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &num_probes, sizeof(num_probes));
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+}
+
+}  // namespace
+
+CoordinatorStats RunCoordinator(int port, size_t unit_size,
+                                int unit_timeout_seconds,
+                                int grace_period_seconds) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0) {
+    Error("Cannot create socket");
+  }
+  const int enable = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (bind(listener, reinterpret_cast<struct sockaddr *>(&address),
+           sizeof(address)) != 0 ||
+      listen(listener, 64) != 0) {
+    Error("Cannot listen on port " + std::to_string(port));
+  }
+  const std::chrono::seconds unit_timeout(unit_timeout_seconds);
+  const std::chrono::seconds grace_period(grace_period_seconds);
+  const SteadyClock::time_point begin_time = SteadyClock::now();
+
+  CoordinatorStats stats;
+  std::map<int, Connection> connections;
+  std::deque<WorkUnit> reassigned_units;
+  bool input_done = false;
+  uint64_t next_unit_id = 0;
+  size_t num_units_in_flight = 0;
+  // Whether and when all work was done.
+  bool done = false;
+  SteadyClock::time_point done_time;
+
+  // Gets the next unit, preferring units that were taken from lost workers.
+  auto next_unit = [&](WorkUnit *unit) {
+    if (!reassigned_units.empty()) {
+      *unit = std::move(reassigned_units.front());
+      reassigned_units.pop_front();
+      return true;
+    }
+    unit->payload.clear();
+    unit->num_metric_spaces = 0;
+    std::string line;
+    while (!input_done && unit->num_metric_spaces < unit_size) {
+      if (!ReadInputLine(&line)) {
+        input_done = true;
+        break;
+      }
+      unit->payload += line;
+      unit->payload += '\n';
+      ++unit->num_metric_spaces;
+    }
+    if (unit->num_metric_spaces == 0) {
+      return false;
+    }
+    unit->id = next_unit_id++;
+    ++stats.num_units;
+    return true;
+  };
+
+  auto disconnect = [&](Connection &connection) {
+    if (connection.has_unit) {
+      std::cerr << ">E dbe coordinator lost a worker; reassigning unit "
+                << connection.unit.id << std::endl;
+      reassigned_units.push_back(std::move(connection.unit));
+      connection.has_unit = false;
+      --num_units_in_flight;
+      ++stats.num_reassigned_units;
+    }
+    close(connection.fd);
+    connection.fd = -1;
+  };
+
+  // Queues a message to a worker and sends what the socket takes right away.
+  auto send_message = [&](Connection &connection, uint64_t type,
+                          uint64_t unit_id, uint64_t num_metric_spaces,
+                          const std::string &payload) {
+    connection.output +=
+        EncodeMessage(type, unit_id, num_metric_spaces, 0, payload);
+    if (!SendAvailable(connection)) {
+      disconnect(connection);
+    }
+  };
+
+  // Gives a unit to a worker that asked for one. If there is no unit, the
+  // worker either waits for units from lost workers, or is told that all
+  // work is done.
+  auto dispatch = [&](Connection &connection) {
+    WorkUnit unit;
+    if (next_unit(&unit)) {
+      connection.unit = std::move(unit);
+      connection.has_unit = true;
+      connection.waiting = false;
+      connection.deadline = unit_timeout_seconds > 0
+                                ? SteadyClock::now() + unit_timeout
+                                : SteadyClock::time_point::max();
+      ++num_units_in_flight;
+      send_message(connection, UNIT, connection.unit.id,
+                   connection.unit.num_metric_spaces, connection.unit.payload);
+    } else if (num_units_in_flight == 0) {
+      connection.waiting = false;
+      connection.closing = true;
+      connection.deadline = SteadyClock::now() + kRequestTimeout;
+      send_message(connection, DONE, 0, 0, "");
+    } else {
+      connection.waiting = true;
+      connection.deadline = SteadyClock::time_point::max();
+    }
+  };
+
+  // Handles the messages that a worker has sent in full.
+  auto receive = [&](Connection &connection) {
+    const bool open = ReceiveAvailable(connection);
+    Message message;
+    bool invalid = false;
+    while (connection.fd >= 0 && TakeMessage(connection, &message, &invalid)) {
+      if (message.type == RESULT && connection.has_unit &&
+          message.unit_id == connection.unit.id) {
+        WriteOutput(message.payload);
+        stats.num_metric_spaces += message.num_metric_spaces;
+        stats.num_output_metric_spaces += message.num_output_metric_spaces;
+        connection.has_unit = false;
+        --num_units_in_flight;
+        dispatch(connection);
+      } else if (message.type == REQUEST && !connection.has_unit &&
+                 !connection.waiting && !connection.closing) {
+        // Only now is the peer known to be a worker.
+        ++stats.num_workers;
+        dispatch(connection);
+      } else {
+        invalid = true;
+        break;
+      }
+    }
+    if (invalid) {
+      std::cerr << ">E dbe coordinator received an unexpected message"
+                << std::endl;
+      disconnect(connection);
+    } else if (!open && connection.fd >= 0) {
+      disconnect(connection);
+    }
+  };
+
+  while (true) {
+    if (!done && input_done && reassigned_units.empty() &&
+        num_units_in_flight == 0) {
+      done = true;
+      done_time = SteadyClock::now();
+    }
+    if (done && connections.empty() &&
+        SteadyClock::now() >= done_time + grace_period) {
+      break;
+    }
+    std::vector<struct pollfd> pollfds = {{listener, POLLIN, 0}};
+    SteadyClock::time_point deadline = SteadyClock::time_point::max();
+    if (done) {
+      // Wake up when the grace period is over.
+      deadline = done_time + grace_period;
+    }
+    for (auto &entry : connections) {
+      const Connection &connection = entry.second;
+      const short events = connection.output.empty() ? POLLIN
+                                                      : POLLIN | POLLOUT;
+      pollfds.push_back({entry.first, events, 0});
+      deadline = std::min(deadline, connection.deadline);
+    }
+    int timeout_ms = -1;
+    if (deadline != SteadyClock::time_point::max()) {
+      const auto remaining = deadline - SteadyClock::now();
+      timeout_ms = std::max<long long>(
+          0, std::chrono::duration_cast<std::chrono::milliseconds>(remaining)
+                     .count() + 1);
+    }
+    if (poll(pollfds.data(), pollfds.size(), timeout_ms) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Error("Cannot poll sockets");
+    }
+
+    if (pollfds[0].revents & POLLIN) {
+      int fd = accept(listener, nullptr, nullptr);
+      if (fd >= 0) {
+        ConfigureSocket(fd);
+        Connection &connection = connections[fd];
+        connection.fd = fd;
+        connection.deadline = SteadyClock::now() + kRequestTimeout;
+      }
+    }
+
+    for (size_t i = 1; i < pollfds.size(); ++i) {
+      Connection &connection = connections[pollfds[i].fd];
+      if (pollfds[i].revents & POLLOUT) {
+        if (!SendAvailable(connection)) {
+          disconnect(connection);
+          continue;
+        }
+      }
+      if (pollfds[i].revents & ~POLLOUT) {
+        receive(connection);
+      }
+    }
+
+    const SteadyClock::time_point now = SteadyClock::now();
+    for (auto &entry : connections) {
+      Connection &connection = entry.second;
+      if (connection.fd < 0) {
+        continue;
+      }
+      if (connection.closing && connection.output.empty()) {
+        // The worker was told that all work is done.
+        close(connection.fd);
+        connection.fd = -1;
+      } else if (now >= connection.deadline) {
+        std::cerr << ">E dbe coordinator timed out waiting for a worker"
+                  << std::endl;
+        disconnect(connection);
+      }
+    }
+
+    // Hand out units taken from lost workers, or finish waiting workers.
+    for (auto &entry : connections) {
+      Connection &connection = entry.second;
+      if (connection.fd >= 0 && connection.waiting &&
+          (!reassigned_units.empty() || num_units_in_flight == 0)) {
+        dispatch(connection);
+      }
+    }
+    for (auto it = connections.begin(); it != connections.end();) {
+      it = (it->second.fd < 0) ? connections.erase(it) : std::next(it);
+    }
+  }
+  close(listener);
+  stats.seconds =
+      std::chrono::duration<double>(done_time - begin_time).count();
+  return stats;
+}
+
+unsigned long long RunWorker(const std::string &address,
+                             const UnitProcessor &process) {
+  const size_t colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    Error("Invalid coordinator address (expected host:port): " + address);
+  }
+  const std::string host = address.substr(0, colon);
+  const std::string port = address.substr(colon + 1);
+
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addresses;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+    Error("Cannot resolve coordinator address " + address);
+  }
+  int fd = -1;
+  const SteadyClock::time_point connect_deadline =
+      SteadyClock::now() + kConnectTimeout;
+  while (true) {
+    for (struct addrinfo *a = addresses; a != nullptr; a = a->ai_next) {
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+        break;
+      }
+      if (fd >= 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    if (fd >= 0 || SteadyClock::now() >= connect_deadline) {
+      break;
+    }
+    std::this_thread::sleep_for(kConnectRetryInterval);
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) {
+    Error("Cannot connect to coordinator " + address);
+  }
+  ConfigureSocket(fd);
+
+  unsigned long long num_metric_spaces = 0;
+  if (!SendMessage(fd, REQUEST, 0, 0, 0, "")) {
+    Error("Lost connection to coordinator");
+  }
+  Message message;
+  std::vector<std::string> lines;
+  std::string output;
+  while (true) {
+    if (!ReceiveMessage(fd, &message)) {
+      Error("Lost connection to coordinator");
+    }
+    if (message.type == DONE) {
+      break;
+    } else if (message.type != UNIT) {
+      Error("Unexpected message from coordinator");
+    }
+
+    lines.clear();
+    size_t start = 0;
+    size_t end;
+    while ((end = message.payload.find('\n', start)) != std::string::npos) {
+      lines.push_back(message.payload.substr(start, end - start));
+      start = end + 1;
+    }
+    output.clear();
+    const unsigned long long num_output = process(lines, &output);
+    num_metric_spaces += lines.size();
+    if (!SendMessage(fd, RESULT, message.unit_id, lines.size(), num_output,
+                     output)) {
+      Error("Lost connection to coordinator");
+    }
+  }
+  close(fd);
+  return num_metric_spaces;
+}
@@ -0,0 +1,44 @@
+#ifndef __DISTRIBUTED_H__
+#define __DISTRIBUTED_H__
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/** Processes a work unit: analyzes the metric space on every line, appends
+the output for the accepted ones, and returns how many were accepted. **/
+typedef std::function<unsigned long long(const std::vector<std::string> &lines,
+                                         std::string *output)>
+    UnitProcessor;
+
+struct CoordinatorStats {
+  unsigned long long num_workers = 0;
+  unsigned long long num_units = 0;
+  unsigned long long num_reassigned_units = 0;
+  unsigned long long num_metric_spaces = 0;
+  unsigned long long num_output_metric_spaces = 0;
+  // Time until all work was done, without the grace period.
+  double seconds = 0;
+};
+
+/** Runs a coordinator that listens for workers on the given TCP port and
+hands out units of unit_size input lines from stdin on demand. The output
+returned by the workers is written to stdout in the order in which the units
+complete. A unit that is in progress when its worker disconnects, sends
+something other than a message of this protocol, or takes longer than
+unit_timeout_seconds (unless 0), is handed to the next worker that asks for
+work. Once all input is processed, workers that still connect are told that
+all work is done for another grace_period_seconds, so that workers started
+late do not fail; then returns. **/
+CoordinatorStats RunCoordinator(int port, size_t unit_size,
+                                int unit_timeout_seconds,
+                                int grace_period_seconds);
+
+/** Runs a worker for the coordinator at host:port, processing units until
+the coordinator reports that there is no more work. If the coordinator does
+not accept connections yet, keeps trying for a few seconds. Returns the number
+of metric spaces processed. **/
+unsigned long long RunWorker(const std::string &address,
+                             const UnitProcessor &process);
+
+#endif
@@ -8,13 +8,16 @@ Example usage:
 
 #include <chrono>
 #include <iostream>
+#include <string>
 
 #include <gflags/gflags.h>
 
 #include "src/common.h"
 #include "src/graphs.h"
+#include "src/io.h"
 
 DEFINE_bool(q, false, "Quiet mode");
+DEFINE_bool(gzip, false, "Write gzip-compressed output");
 
 void ParseCommandLineFlags(int argc, char *argv[]) {
   gflags::SetUsageMessage("Distance matrix calculator.");
@@ -24,6 +27,7 @@ void ParseCommandLineFlags(int argc, char *argv[]) {
 
 int main(int argc, char *argv[]) {
   ParseCommandLineFlags(argc, argv);
+  SetOutputCompression(FLAGS_gzip);
 
   if (!FLAGS_q) {
     std::cerr << ">A g2dist" << std::endl;
@@ -40,13 +44,14 @@ int main(int argc, char *argv[]) {
     DistanceMatrix distance_matrix(num_vertices);
     GetDistanceMatrix(graph, &distance_matrix);
     DistanceMatrixMap dist(distance_matrix, graph);
-    std::cout << num_vertices << " ";
+    std::string output = std::to_string(num_vertices) + " ";
     for (int i = 0; i < num_vertices; ++i) {
       for (int j = i + 1; j < num_vertices; ++j) {
-        std::cout << dist[i][j];
-        std::cout << " ";
+        output += std::to_string(dist[i][j]);
+        output += " ";
       }
     }
+    WriteOutput(output);
     WriteGraph(graph);
   }
 
@@ -0,0 +1,153 @@
+/** In-process De Bruijn-Erdos checker for geng-generated graphs.
+
+Runs nauty's geng inside this process and analyzes every generated graph
+directly from geng's output hook, so that no graphs are written to or parsed
+from a pipe. The analysis and filter flags are the same as those of dbe.
+
+Example usage:
+
+    NAUTY="../nauty26r11"
+    ./gengdbe -b -C -u 6 | $NAUTY/showg -A
+
+which is equivalent to
+
+    $NAUTY/geng -b -C 6 | ./g2dist | ./dbe -u | $NAUTY/showg -A
+**/
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include "src/analysis.h"
+#include "src/common.h"
+#include "src/dbe_flags.h"
+#include "src/graphs.h"
+
+DEFINE_bool(q, false, "Quiet mode");
+DEFINE_bool(b, false, "geng: only generate bipartite graphs");
+DEFINE_bool(c, false, "geng: only generate connected graphs");
+DEFINE_bool(C, false, "geng: only generate biconnected graphs");
+DEFINE_int32(d, 0, "geng: lower bound on the minimum degree");
+DEFINE_int32(D, 0, "geng: upper bound on the maximum degree (0 for none)");
+DEFINE_int32(res, 0, "geng: only generate part res of mod parts");
+DEFINE_int32(mod, 1, "geng: number of parts to split the output into");
+
+extern "C" {
+/** The main function of geng.c, renamed by compiling with -DGENG_MAIN. **/
+int GengMain(int argc, char *argv[]);
+
+/** Output hook of geng.c, installed by compiling with -DOUTPROC. **/
+void GengOutProc(FILE *outfile, graph *g, int n);
+}
+
+AnalysisOptions options;
+FilterOptions filter;
+unsigned long long num_graphs = 0;
+unsigned long long num_output_graphs = 0;
+
+void ParseCommandLineFlags(int *argc, char **argv[]) {
+  gflags::SetUsageMessage(
+      "In-process De Bruijn-Erdos checker for geng-generated graphs.\n"
+      "Syntax: gengdbe [FLAGS] <ORDER>");
+  gflags::SetVersionString("1.0.0");
+  gflags::ParseCommandLineFlags(argc, argv, true);
+}
+
+/** Converts a dense nauty graph with one setword per row to a Graph. **/
+Graph DenseGraphToBgl(graph *g, int n) {
+  Graph result(n);
+  for (int i = 0; i < n; ++i) {
+    for (int j = i + 1; j < n; ++j) {
+      if (ISELEMENT(GRAPHROW(g, i, 1), j)) {
+        boost::add_edge(i, j, result);
+      }
+    }
+  }
+  return result;
+}
+
+// Output goes to stdout through WriteOutput, not to geng's output file.
+void GengOutProc(FILE * /* outfile */, graph *g, int n) {
+  ++num_graphs;
+  Graph graph = DenseGraphToBgl(g, n);
+  DistanceMatrix distance_matrix(n);
+  GetDistanceMatrix(graph, &distance_matrix);
+  DistanceMatrixMap dist(distance_matrix, graph);
+
+  MetricSpaceInfo info;
+  bool valid = AnalyzeMetricSpace(n, dist, options, &info);
+  if (!valid || !AcceptMetricSpace(info, filter)) {
+    return;
+  }
+  ++num_output_graphs;
+  WriteGraph(graph);
+}
+
+/** Builds the argument list for geng from the command line flags. **/
+std::vector<std::string> GengArguments(const std::string &order) {
+  std::vector<std::string> arguments = {"geng", "-q"};
+  if (FLAGS_b) {
+    arguments.push_back("-b");
+  }
+  if (FLAGS_c) {
+    arguments.push_back("-c");
+  }
+  if (FLAGS_C) {
+    arguments.push_back("-C");
+  }
+  if (FLAGS_d > 0) {
+    arguments.push_back("-d" + std::to_string(FLAGS_d));
+  }
+  if (FLAGS_D > 0) {
+    arguments.push_back("-D" + std::to_string(FLAGS_D));
+  }
+  arguments.push_back(order);
+  if (FLAGS_mod > 1) {
+    arguments.push_back(std::to_string(FLAGS_res) + "/" +
+                        std::to_string(FLAGS_mod));
+  }
+  return arguments;
+}
+
+int main(int argc, char *argv[]) {
+  ParseCommandLineFlags(&argc, &argv);
+  if (argc != 2) {
+    Error("Please specify the order of the graphs to generate");
+  }
+  char *end;
+  const long order = strtol(argv[1], &end, 10);
+  if (end == argv[1] || *end != '\0' || order < 1) {
+    Error(std::string("Invalid order: ") + argv[1]);
+  }
+  if (order > MAX_N) {
+    Error("Order too large");
+  }
+
+  if (!FLAGS_q) {
+    std::cerr << ">A gengdbe" << std::endl;
+  }
+
+  options = GetAnalysisOptions();
+  filter = GetFilterOptions();
+
+  std::vector<std::string> arguments = GengArguments(argv[1]);
+  std::vector<char *> geng_argv;
+  for (std::string &argument : arguments) {
+    geng_argv.push_back(const_cast<char *>(argument.c_str()));
+  }
+  geng_argv.push_back(nullptr);
+
+  auto begin_time = Clock::now();
+  GengMain(arguments.size(), geng_argv.data());
+
+  if (!FLAGS_q) {
+    std::cerr << ">Z gengdbe analyzed " << num_graphs << " graphs in "
+              << GetMillisecondsSince(begin_time) / 1000.0 << " seconds; "
+              << num_output_graphs << " graphs output" << std::endl;
+  }
+  gflags::ShutDownCommandLineFlags();
+  return 0;
+}
@@ -0,0 +1,80 @@
+import re
+import subprocess
+import unittest
+
+
+def Run(binary, args, input=None):
+  process = subprocess.Popen([binary] + list(args),
+      stdin=subprocess.PIPE,
+      stderr=subprocess.PIPE,
+      stdout=subprocess.PIPE)
+  stdout, stderr = process.communicate(input=input)
+  stdout = [line for line in stdout.split('\n') if line]
+  stderr = [line for line in stderr.split('\n') if line]
+  return stdout, stderr
+
+
+def Summary(stderr, pattern):
+  """Gets the numbers from the '>Z' line that matches the given pattern."""
+  for line in stderr:
+    match = re.match(pattern, line)
+    if match:
+      return [int(number) for number in match.groups()]
+  raise AssertionError('No line matches %s in %s' % (pattern, stderr))
+
+
+class GengDbeTest(unittest.TestCase):
+
+  def assertMatchesDbe(self, geng_args, dbe_args):
+    """Checks that gengdbe outputs the same graphs as dbe -g does on all graphs
+    that gengdbe generates, and that it reports the same counts."""
+    graphs, _ = Run('gengdbe', ['-q'] + geng_args)
+    stdout, stderr = Run('gengdbe', dbe_args + geng_args)
+    num_graphs, num_output = Summary(
+        stderr, r'>Z gengdbe analyzed (\d+) graphs in .* seconds; (\d+) graphs')
+    expected, expected_stderr = Run('dbe', ['-g'] + dbe_args,
+                                    '\n'.join(graphs))
+    [expected_num_graphs] = Summary(
+        expected_stderr, r'>Z dbe analyzed (\d+) metric spaces')
+    self.assertEqual(stdout, expected)
+    self.assertEqual(num_graphs, len(graphs))
+    self.assertEqual(num_graphs, expected_num_graphs)
+    self.assertEqual(num_output, len(expected))
+
+  def testAllGraphs(self):
+    stdout, stderr = Run('gengdbe', ['5'])
+    self.assertEqual(len(stdout), 34)
+    self.assertEqual(Summary(stderr, r'>Z gengdbe analyzed (\d+) graphs in .* '
+                                     r'seconds; (\d+) graphs'), [34, 34])
+
+  def testConnectedGraphs(self):
+    stdout, _ = Run('gengdbe', ['-c', '5'])
+    self.assertEqual(len(stdout), 21)
+    stdout, _ = Run('gengdbe', ['-c', '6'])
+    self.assertEqual(len(stdout), 112)
+
+  def testNonUniversal(self):
+    self.assertMatchesDbe(['-c', '6'], ['-u'])
+
+  def testBipartite(self):
+    self.assertMatchesDbe(['-b', '6'], ['-u'])
+    self.assertMatchesDbe(['-b', '6'], ['-n'])
+    self.assertMatchesDbe(['-b', '-C', '6'], [])
+    self.assertMatchesDbe(['-b', '-C', '6'], ['-u'])
+
+  def testResMod(self):
+    whole, _ = Run('gengdbe', ['-c', '-u', '6'])
+    parts = []
+    for res in range(3):
+      part, _ = Run('gengdbe', ['-c', '-u', '--res=%d' % res, '--mod=3', '6'])
+      parts += part
+    self.assertEqual(sorted(parts), sorted(whole))
+    self.assertMatchesDbe(['-c', '--res=1', '--mod=3', '6'], ['-u'])
+
+  def testInvalidOrder(self):
+    _, stderr = Run('gengdbe', ['six'])
+    self.assertEqual(stderr, ['ERROR: Invalid order: six'])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -1,18 +1,17 @@
 #include <algorithm>
+#include <cstring>
 #include <iostream>
 
 #include "common.h"
 #include "graphs.h"
+#include "io.h"
 
 /** Reads a non-empty line from stdin. **/
 boost::optional<std::string> ReadLine() {
   std::string line;
-  do {
-    if (std::cin.eof()) {
-      return boost::none;
-    }
-    std::getline(std::cin, line);
-  } while (line.length() == 0);
+  if (!ReadInputLine(&line)) {
+    return boost::none;
+  }
   return line;
 }
 
@@ -47,7 +46,7 @@ void WriteGraph(const Graph &graph) {
   sparsegraph sg;
   BglToSparseGraph(graph, sg);
   char *sgraph6 = sgtos6(&sg);
-  std::cout << sgraph6;
+  WriteOutput(sgraph6, strlen(sgraph6));
   // Note: sgraph6 should not be deallocated, because it refers to global
   // variable in gtools.c.
   SG_FREE(sg);
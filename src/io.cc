@@ -0,0 +1,482 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "io.h"
+
+namespace {
+
+const size_t kReadBlockSize = 1 << 20;
+const size_t kQueueCapacity = 16;
+// Favour throughput: level 1 already shrinks our text formats several-fold.
+const int kCompressionLevel = 1;
+
+/** Aborts from a background thread. Unlike Error, this does not run static
+destructors, which would wait for the very thread that is failing. **/
+void Fail(const std::string &message) {
+  std::cerr << "ERROR: " << message << std::endl;
+  std::_Exit(1);
+}
+
+// The number of OutputWriter threads that are still running, and the signal
+// (SIGINT or SIGTERM) that asked them to write out their output and end the
+// process, if any.
+std::atomic<int> num_running_writers{0};
+std::atomic<int> interrupt_signal{0};
+
+void HandleInterrupt(int signal) {
+  interrupt_signal.store(signal);
+  // Without writer threads, nothing is buffered; the handler has reset itself,
+  // so this ends the process once the handler returns.
+  if (num_running_writers.load() == 0) {
+    raise(signal);
+  }
+}
+
+/** Makes SIGINT and SIGTERM write out buffered output before ending the
+process, unless they are ignored. A second signal ends the process at once. **/
+void InstallInterruptHandlers() {
+  for (int signal : {SIGINT, SIGTERM}) {
+    struct sigaction action;
+    if (sigaction(signal, nullptr, &action) != 0 ||
+        action.sa_handler != SIG_DFL) {
+      continue;
+    }
+    action = {};
+    action.sa_handler = HandleInterrupt;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(signal, &action, nullptr);
+  }
+}
+
+bool IsGzip(const char *data, size_t length) {
+  return length >= 2 && static_cast<unsigned char>(data[0]) == 0x1f &&
+         static_cast<unsigned char>(data[1]) == 0x8b;
+}
+
+/** Reads the bytes of a file descriptor, decompressing them if they turn out
+to be gzip-compressed. Concatenated gzip streams are decompressed as one. **/
+class InputSource {
+public:
+  explicit InputSource(int fd) : fd_(fd), input_(kReadBlockSize) {}
+
+  ~InputSource() {
+    if (gzip_) {
+      inflateEnd(&stream_);
+    }
+  }
+
+  /** Reads up to size bytes into buffer. Returns 0 at the end of input. **/
+  size_t Read(char *buffer, size_t size) {
+    if (!started_) {
+      started_ = true;
+      // A pipe may deliver the two magic bytes in separate reads.
+      size_t num_read;
+      do {
+        num_read = ReadRaw(input_.data() + input_size_,
+                           input_.size() - input_size_);
+        input_size_ += num_read;
+      } while (input_size_ < 2 && num_read > 0);
+      gzip_ = IsGzip(input_.data(), input_size_);
+      if (gzip_) {
+        stream_ = z_stream();
+        if (inflateInit2(&stream_, 15 + 16) != Z_OK) {
+          Fail("Cannot initialize decompression");
+        }
+        stream_.next_in = reinterpret_cast<Bytef *>(input_.data());
+        stream_.avail_in = input_size_;
+      }
+    }
+    if (!gzip_) {
+      // Hand out what was read to look for the gzip header first.
+      if (input_size_ > 0) {
+        const size_t length = std::min(size, input_size_);
+        memcpy(buffer, input_.data() + input_offset_, length);
+        input_offset_ += length;
+        input_size_ -= length;
+        return length;
+      }
+      return ReadRaw(buffer, size);
+    }
+    return Inflate(buffer, size);
+  }
+
+private:
+  size_t ReadRaw(char *buffer, size_t size) {
+    ssize_t num_read;
+    do {
+      num_read = read(fd_, buffer, size);
+    } while (num_read < 0 && errno == EINTR);
+    if (num_read < 0) {
+      Fail(std::string("Cannot read input: ") + strerror(errno));
+    }
+    return num_read;
+  }
+
+  size_t Inflate(char *buffer, size_t size) {
+    stream_.next_out = reinterpret_cast<Bytef *>(buffer);
+    stream_.avail_out = size;
+    while (stream_.avail_out == size) {
+      if (stream_.avail_in == 0) {
+        stream_.next_in = reinterpret_cast<Bytef *>(input_.data());
+        stream_.avail_in = ReadRaw(input_.data(), input_.size());
+        if (stream_.avail_in == 0) {
+          if (!stream_ended_) {
+            Fail("Truncated compressed input");
+          }
+          break;
+        }
+      }
+      if (stream_ended_) {
+        // Another gzip stream follows.
+        inflateReset(&stream_);
+        stream_ended_ = false;
+      }
+      const int result = inflate(&stream_, Z_NO_FLUSH);
+      if (result == Z_STREAM_END) {
+        stream_ended_ = true;
+      } else if (result != Z_OK && result != Z_BUF_ERROR) {
+        Fail("Corrupt compressed input");
+      }
+    }
+    return size - stream_.avail_out;
+  }
+
+  int fd_;
+  std::vector<char> input_;
+  size_t input_offset_ = 0;
+  size_t input_size_ = 0;
+  bool started_ = false;
+  bool gzip_ = false;
+  bool stream_ended_ = false;
+  z_stream stream_;
+};
+
+/** Appends the non-empty lines in data[begin, end) to lines, and returns the
+offset just past the last complete line. If at_end is set, a final line
+without terminating newline is included too. **/
+size_t SplitLines(const char *data, size_t begin, size_t end, bool at_end,
+                  std::vector<std::pair<size_t, size_t>> *lines) {
+  size_t start = begin;
+  while (start < end) {
+    const char *newline =
+        static_cast<const char *>(memchr(data + start, '\n', end - start));
+    if (newline == nullptr) {
+      break;
+    }
+    const size_t stop = newline - data;
+    if (stop > start) {
+      lines->emplace_back(start, stop - start);
+    }
+    start = stop + 1;
+  }
+  if (at_end && start < end) {
+    lines->emplace_back(start, end - start);
+    start = end;
+  }
+  return start;
+}
+
+}  // namespace
+
+LineReader::LineReader(int fd) : fd_(fd), queue_(kQueueCapacity) {
+  thread_ = std::thread(&LineReader::Run, this);
+}
+
+LineReader::~LineReader() {
+  thread_.join();
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  }
+}
+
+bool LineReader::Next(std::string *line) {
+  while (!batch_ || next_line_ == batch_->lines.size()) {
+    if (done_) {
+      return false;
+    }
+    batch_ = queue_.Pop();
+    next_line_ = 0;
+    if (!batch_) {
+      done_ = true;
+      return false;
+    }
+  }
+  const std::pair<size_t, size_t> &span = batch_->lines[next_line_++];
+  line->assign(batch_->base + span.first, span.second);
+  return true;
+}
+
+bool LineReader::Ready() const {
+  return done_ || (batch_ && next_line_ < batch_->lines.size()) ||
+         queue_.Ready();
+}
+
+void LineReader::Run() {
+  if (!RunMapped()) {
+    RunUnmapped();
+  }
+  queue_.Push(nullptr);
+}
+
+/** Splits a regular file into batches straight from a memory mapping. Returns
+false if the input is not a regular file, is compressed, or cannot be
+mapped. **/
+bool LineReader::RunMapped() {
+  struct stat status;
+  if (fstat(fd_, &status) != 0 || !S_ISREG(status.st_mode)) {
+    return false;
+  }
+  const off_t offset = lseek(fd_, 0, SEEK_CUR);
+  if (offset < 0 || status.st_size <= offset) {
+    return false;
+  }
+  char magic[2];
+  if (pread(fd_, magic, sizeof(magic), offset) != sizeof(magic) ||
+      IsGzip(magic, sizeof(magic))) {
+    return false;
+  }
+  void *mapping =
+      mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+  mapping_ = mapping;
+  mapping_size_ = status.st_size;
+
+  const char *data = static_cast<const char *>(mapping);
+  size_t start = offset;
+  while (start < mapping_size_) {
+    std::unique_ptr<LineBatch> batch(new LineBatch());
+    batch->base = data;
+    size_t end = std::min(start + kReadBlockSize, mapping_size_);
+    // Extend the block to the end of the line it stops in.
+    const char *newline = static_cast<const char *>(
+        memchr(data + end - 1, '\n', mapping_size_ - end + 1));
+    end = (newline == nullptr) ? mapping_size_ : (newline - data) + 1;
+    start = SplitLines(data, start, end, end == mapping_size_, &batch->lines);
+    if (!batch->lines.empty()) {
+      queue_.Push(std::move(batch));
+    }
+  }
+  return true;
+}
+
+/** Reads the input with read(2) in large blocks, decompressing it if needed,
+and carries incomplete lines over to the next block. **/
+void LineReader::RunUnmapped() {
+  InputSource source(fd_);
+  std::string pending;
+  bool at_end = false;
+  while (!at_end) {
+    std::unique_ptr<LineBatch> batch(new LineBatch());
+    std::string &storage = batch->storage;
+    storage.swap(pending);
+    const size_t old_size = storage.size();
+    storage.resize(old_size + kReadBlockSize);
+    const size_t num_read = source.Read(&storage[old_size], kReadBlockSize);
+    at_end = (num_read == 0);
+    storage.resize(old_size + num_read);
+
+    const size_t consumed =
+        SplitLines(storage.data(), 0, storage.size(), at_end, &batch->lines);
+    pending.assign(storage, consumed, std::string::npos);
+    storage.resize(consumed);
+    batch->base = storage.data();
+    if (!batch->lines.empty()) {
+      queue_.Push(std::move(batch));
+    }
+  }
+}
+
+constexpr std::chrono::milliseconds OutputWriter::kFlushInterval;
+
+OutputWriter::OutputWriter(int fd, bool compress)
+    : fd_(fd), compress_(compress), queue_(kQueueCapacity) {
+  static std::once_flag handlers_installed;
+  std::call_once(handlers_installed, InstallInterruptHandlers);
+  buffer_.reserve(kBlockSize);
+  ++num_running_writers;
+  thread_ = std::thread(&OutputWriter::Run, this);
+}
+
+OutputWriter::~OutputWriter() { Close(); }
+
+void OutputWriter::Flush() {
+  std::unique_ptr<std::string> block;
+  {
+    std::lock_guard<std::mutex> lock(buffer_mutex_);
+    if (buffer_.empty()) {
+      return;
+    }
+    block.reset(new std::string(std::move(buffer_)));
+    buffer_ = std::string();
+    buffer_.reserve(kBlockSize);
+    ++num_unwritten_blocks_;
+  }
+  queue_.Push(std::move(block));
+}
+
+/** Takes what the producer has buffered so far into block, unless blocks that
+were handed over earlier are still to be written. Returns false in that
+case. **/
+bool OutputWriter::TakeBuffer(std::string *block) {
+  std::lock_guard<std::mutex> lock(buffer_mutex_);
+  if (num_unwritten_blocks_ > 0) {
+    return false;
+  }
+  block->clear();
+  block->swap(buffer_);
+  return true;
+}
+
+void OutputWriter::Close() {
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  Flush();
+  queue_.Push(nullptr);
+  thread_.join();
+}
+
+void OutputWriter::Run() {
+  z_stream stream = z_stream();
+  std::vector<char> compressed(kBlockSize);
+  if (compress_ && deflateInit2(&stream, kCompressionLevel, Z_DEFLATED,
+                                15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    Fail("Cannot initialize compression");
+  }
+
+  // Writes out data, compressing it if needed. Z_SYNC_FLUSH makes everything
+  // so far decompressible, and Z_FINISH ends the stream.
+  auto write_data = [&](const char *data, size_t length, int flush) {
+    if (!compress_) {
+      WriteBlock(data, length);
+      return;
+    }
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    stream.avail_in = length;
+    int result;
+    do {
+      stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+      stream.avail_out = compressed.size();
+      result = deflate(&stream, flush);
+      WriteBlock(compressed.data(), compressed.size() - stream.avail_out);
+    } while (stream.avail_out == 0 ||
+             (flush == Z_FINISH && result != Z_STREAM_END));
+  };
+
+  // Writes a block that the producer handed over.
+  auto write_block = [&](const std::string &block) {
+    write_data(block.data(), block.size(), Z_NO_FLUSH);
+    std::lock_guard<std::mutex> lock(buffer_mutex_);
+    --num_unwritten_blocks_;
+  };
+
+  std::string buffered;
+  std::unique_ptr<std::string> block;
+  bool finished = false;
+  while (!finished && interrupt_signal.load() == 0) {
+    if (!queue_.PopFor(&block, kFlushInterval)) {
+      // Output is slow: write out what has been buffered so far.
+      if (TakeBuffer(&buffered) && !buffered.empty()) {
+        write_data(buffered.data(), buffered.size(), Z_SYNC_FLUSH);
+      }
+      continue;
+    }
+    if (!block) {
+      // An empty pop marks the end of the output.
+      write_data(nullptr, 0, Z_FINISH);
+      finished = true;
+    } else {
+      write_block(*block);
+    }
+  }
+
+  const int signal = interrupt_signal.load();
+  if (!finished) {
+    // Interrupted: write out everything so far as a complete stream, which the
+    // readers of our own tools accept, and end the process.
+    while (!TakeBuffer(&buffered)) {
+      if (queue_.PopFor(&block, kFlushInterval) && block) {
+        write_block(*block);
+      }
+    }
+    write_data(buffered.data(), buffered.size(), Z_FINISH);
+  }
+  if (compress_) {
+    deflateEnd(&stream);
+  }
+  if (--num_running_writers == 0 && signal != 0) {
+    raise(signal);
+  }
+}
+
+void OutputWriter::WriteBlock(const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t num_written = write(fd_, data, length);
+    if (num_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Fail(std::string("Cannot write output: ") + strerror(errno));
+    }
+    data += num_written;
+    length -= num_written;
+  }
+}
+
+namespace {
+
+LineReader &StdinReader() {
+  // Intentionally never destroyed: at exit, the reader thread may still be
+  // blocked reading stdin.
+  static LineReader *reader = new LineReader(STDIN_FILENO);
+  return *reader;
+}
+
+bool compress_output = false;
+
+OutputWriter &StdoutWriter() {
+  // Destroyed at exit, which writes out any buffered output.
+  static OutputWriter writer(STDOUT_FILENO, compress_output);
+  return writer;
+}
+
+}  // namespace
+
+/** Reads a non-empty line from stdin. Returns false at the end of input. **/
+bool ReadInputLine(std::string *line) { return StdinReader().Next(line); }
+
+/** Returns whether ReadInputLine would return without waiting for input. **/
+bool InputLineReady() { return StdinReader().Ready(); }
+
+/** Sets whether output to stdout is gzip-compressed. Must be called before
+anything is written to stdout. **/
+void SetOutputCompression(bool compress) {
+  compress_output = compress;
+  if (compress) {
+    // Start the writer now, so that even empty output is a valid gzip file.
+    StdoutWriter();
+  }
+}
+
+/** Writes text to stdout. **/
+void WriteOutput(const char *text, size_t length) {
+  StdoutWriter().Write(text, length);
+}
+
+void WriteOutput(const std::string &text) {
+  StdoutWriter().Write(text);
+}
@@ -0,0 +1,219 @@
+#ifndef __IO_H__
+#define __IO_H__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/** Bounded lock-free queue for exactly one producer and one consumer thread.
+Push blocks while the queue is full, and Pop blocks while it is empty: a
+waiting thread spins briefly and then sleeps on a condition variable until the
+other side makes progress, so an idle pipeline stage uses no CPU. **/
+template <class T> class SpscQueue {
+public:
+  /** Creates a queue; the capacity must be a power of two. **/
+  explicit SpscQueue(size_t capacity) : slots_(capacity) {}
+
+  void Push(T value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    WaitUntil(producer_waiting_, not_full_, kForever, [&] {
+      return tail - head_.load(std::memory_order_acquire) != slots_.size();
+    });
+    slots_[tail & (slots_.size() - 1)] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    Wake(consumer_waiting_, not_empty_);
+  }
+
+  T Pop() {
+    T value;
+    PopFor(&value, kForever);
+    return value;
+  }
+
+  /** Returns whether Pop would return without waiting. Only for use by the
+  consumer. **/
+  bool Ready() const {
+    return tail_.load(std::memory_order_acquire) !=
+           head_.load(std::memory_order_relaxed);
+  }
+
+  /** Like Pop, but gives up after the given time. Returns false if nothing
+  arrived in time. **/
+  bool PopFor(T *value, std::chrono::milliseconds timeout) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (!WaitUntil(consumer_waiting_, not_empty_, timeout, [&] {
+          return tail_.load(std::memory_order_acquire) != head;
+        })) {
+      return false;
+    }
+    *value = std::move(slots_[head & (slots_.size() - 1)]);
+    head_.store(head + 1, std::memory_order_release);
+    Wake(producer_waiting_, not_full_);
+    return true;
+  }
+
+private:
+  static constexpr std::chrono::milliseconds kForever =
+      std::chrono::milliseconds::max();
+
+  /** Waits until ready() holds: first yield a few times, then sleep until
+  woken by the other side or until the timeout passes. Returns whether ready()
+  holds. **/
+  template <class P>
+  bool WaitUntil(std::atomic<bool> &waiting, std::condition_variable &cv,
+                 std::chrono::milliseconds timeout, P ready) {
+    for (int spins = 0; spins < 64; ++spins) {
+      if (ready()) {
+        return true;
+      }
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    waiting.store(true, std::memory_order_relaxed);
+    // Pairs with the fence in Wake: either the other side sees that this side
+    // is waiting, or this side sees its progress.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool result = true;
+    if (timeout == kForever) {
+      cv.wait(lock, ready);
+    } else {
+      result = cv.wait_for(lock, timeout, ready);
+    }
+    waiting.store(false, std::memory_order_relaxed);
+    return result;
+  }
+
+  /** Wakes the other side if it is sleeping. **/
+  void Wake(std::atomic<bool> &waiting, std::condition_variable &cv) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv.notify_one();
+    }
+  }
+
+  std::vector<T> slots_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) std::atomic<bool> producer_waiting_{false};
+  std::atomic<bool> consumer_waiting_{false};
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+};
+
+template <class T>
+constexpr std::chrono::milliseconds SpscQueue<T>::kForever;
+
+/** A block of input text, together with the non-empty lines it contains. **/
+struct LineBatch {
+  // Owns the text when it was read with read(2); empty for mapped files.
+  std::string storage;
+  // Start of the text, either in storage or in a memory-mapped file.
+  const char *base = nullptr;
+  // Offset and length of each line, relative to base.
+  std::vector<std::pair<size_t, size_t>> lines;
+};
+
+/** Reads lines from a file descriptor on a background thread. Regular files
+are memory-mapped; anything else is read in large blocks. Gzip-compressed input
+is recognized and decompressed on the reader thread. The lines are split on the
+reader thread and handed to the consumer in batches. **/
+class LineReader {
+public:
+  explicit LineReader(int fd);
+  ~LineReader();
+
+  /** Gets the next non-empty line. Returns false at the end of the input. **/
+  bool Next(std::string *line);
+
+  /** Returns whether Next would return without waiting for input. **/
+  bool Ready() const;
+
+private:
+  void Run();
+  bool RunMapped();
+  void RunUnmapped();
+
+  int fd_;
+  void *mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  SpscQueue<std::unique_ptr<LineBatch>> queue_;
+  std::unique_ptr<LineBatch> batch_;
+  size_t next_line_ = 0;
+  bool done_ = false;
+  std::thread thread_;
+};
+
+/** Writes output to a file descriptor on a background thread. Output is
+collected in large blocks, which the writer thread (optionally) compresses with
+gzip and writes out with write(2). Output that trickles in slowly is written
+out by the writer thread after at most kFlushInterval, so that rare results
+show up while a long run is still going. Close (or destruction) writes out
+everything that is still buffered, and so does SIGINT or SIGTERM before it
+ends the process. **/
+class OutputWriter {
+public:
+  explicit OutputWriter(int fd, bool compress = false);
+  ~OutputWriter();
+
+  void Write(const char *data, size_t length) {
+    std::unique_lock<std::mutex> lock(buffer_mutex_);
+    buffer_.append(data, length);
+    if (buffer_.size() >= kBlockSize) {
+      lock.unlock();
+      Flush();
+    }
+  }
+
+  void Write(const std::string &text) { Write(text.data(), text.size()); }
+
+  /** Hands the buffered output to the writer thread. **/
+  void Flush();
+
+  /** Writes out all buffered output and stops the writer thread. **/
+  void Close();
+
+  static const size_t kBlockSize = 1 << 20;
+  static constexpr std::chrono::milliseconds kFlushInterval{100};
+
+private:
+  void Run();
+  bool TakeBuffer(std::string *block);
+  void WriteBlock(const char *data, size_t length);
+
+  int fd_;
+  bool compress_;
+  // The buffer is shared with the writer thread, which takes it when output
+  // is slow. Blocks that were taken from it but are not yet written out are
+  // counted in num_unwritten_blocks_, so that the writer thread never takes
+  // the buffer ahead of them.
+  std::mutex buffer_mutex_;
+  std::string buffer_;
+  size_t num_unwritten_blocks_ = 0;
+  SpscQueue<std::unique_ptr<std::string>> queue_;
+  std::thread thread_;
+  bool closed_ = false;
+};
+
+/** Reads a non-empty line from stdin. Returns false at the end of input. **/
+bool ReadInputLine(std::string *line);
+
+/** Returns whether ReadInputLine would return without waiting for input. **/
+bool InputLineReady();
+
+/** Sets whether output to stdout is gzip-compressed. Must be called before
+anything is written to stdout. **/
+void SetOutputCompression(bool compress);
+
+/** Writes text to stdout. **/
+void WriteOutput(const char *text, size_t length);
+void WriteOutput(const std::string &text);
+
+#endif
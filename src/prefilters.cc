@@ -0,0 +1,133 @@
+#include <algorithm>
+
+#include "src/common.h"
+#include "src/prefilters.h"
+
+namespace {
+
+/** Depth-first search from v, which was reached from parent, that computes
+discovery times and low links. Returns true as soon as a bridge is found. **/
+bool FindBridge(const AdjacencyMasks &graph, int v, int parent, int *time,
+                int *discovered, int *low) {
+  discovered[v] = low[v] = ++*time;
+  for (uint64_t rest = graph.neighbors[v]; rest != 0; rest &= rest - 1) {
+    const int w = __builtin_ctzll(rest);
+    if (discovered[w] == 0) {
+      if (FindBridge(graph, w, v, time, discovered, low)) {
+        return true;
+      }
+      low[v] = std::min(low[v], low[w]);
+      if (low[w] > discovered[v]) {
+        // No vertex below w reaches v or above, so vw is a bridge.
+        return true;
+      }
+    } else if (w != parent) {
+      low[v] = std::min(low[v], discovered[w]);
+    }
+  }
+  return false;
+}
+
+bool IsConnected(const AdjacencyMasks &graph) {
+  if (graph.num_vertices == 0) {
+    return true;
+  }
+  const uint64_t all = (graph.num_vertices == 64)
+                           ? ~0ULL
+                           : (1ULL << graph.num_vertices) - 1;
+  uint64_t reached = 1;
+  uint64_t frontier = 1;
+  while (frontier != 0) {
+    uint64_t next = 0;
+    for (uint64_t rest = frontier; rest != 0; rest &= rest - 1) {
+      next |= graph.neighbors[__builtin_ctzll(rest)];
+    }
+    frontier = next & ~reached;
+    reached |= next;
+  }
+  return reached == all;
+}
+
+}  // namespace
+
+bool PendantVertexPrefilter::HasUniversalLine(
+    const AdjacencyMasks &graph) const {
+  for (int v = 0; v < graph.num_vertices; ++v) {
+    if (__builtin_popcountll(graph.neighbors[v]) == 1) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BridgePrefilter::HasUniversalLine(const AdjacencyMasks &graph) const {
+  if (graph.num_vertices == 0) {
+    return false;
+  }
+  int discovered[64] = {0};
+  int low[64];
+  int time = 0;
+  return FindBridge(graph, 0, -1, &time, discovered, low);
+}
+
+Prefilters::Prefilters(const AnalysisOptions &options) {
+  if (!options.skip_spaces_with_universal_line) {
+    return;
+  }
+  // Cheapest first.
+  filters_.emplace_back(new PendantVertexPrefilter());
+  filters_.emplace_back(new BridgePrefilter());
+}
+
+bool Prefilters::Rejects(const Graph &graph) {
+  const int num_vertices = boost::num_vertices(graph);
+  if (filters_.empty() || num_vertices > 64) {
+    return false;
+  }
+  auto begin_time = Clock::now();
+  AdjacencyMasks masks;
+  masks.num_vertices = num_vertices;
+  for (int v = 0; v < num_vertices; ++v) {
+    masks.neighbors[v] = 0;
+    boost::graph_traits<Graph>::adjacency_iterator it, end;
+    for (boost::tie(it, end) = boost::adjacent_vertices(v, graph); it != end;
+         ++it) {
+      masks.neighbors[v] |= 1ULL << *it;
+    }
+  }
+  bool rejected = false;
+  if (IsConnected(masks)) {
+    for (auto &filter : filters_) {
+      ++filter->num_tested;
+      if (filter->HasUniversalLine(masks)) {
+        ++filter->num_rejected;
+        rejected = true;
+        break;
+      }
+    }
+  }
+  filter_time_ += Clock::now() - begin_time;
+  return rejected;
+}
+
+void Prefilters::PrintStatistics(std::ostream &stream) const {
+  unsigned long long num_rejected = 0;
+  for (const auto &filter : filters_) {
+    stream << ">Z dbe pre-filter " << filter->name() << " rejected "
+           << filter->num_rejected << " of " << filter->num_tested
+           << " graphs" << std::endl;
+    num_rejected += filter->num_rejected;
+  }
+  // Estimate the time that the rejected graphs would have taken from the
+  // average over the graphs that were analyzed.
+  double seconds_saved = -std::chrono::duration<double>(filter_time_).count();
+  if (num_analyzed_ > 0) {
+    seconds_saved += num_rejected *
+                     std::chrono::duration<double>(analysis_time_).count() /
+                     num_analyzed_;
+  }
+  stream << ">Z dbe pre-filters took "
+         << std::chrono::duration<double>(filter_time_).count()
+         << " seconds and saved an estimated " << seconds_saved
+         << " seconds" << std::endl;
+}
@@ -0,0 +1,93 @@
+#ifndef __PREFILTERS_H__
+#define __PREFILTERS_H__
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "src/analysis.h"
+#include "src/graphs.h"
+
+/** Neighbors of every vertex of a graph with at most 64 vertices, as bitmasks,
+for quick structural tests. **/
+struct AdjacencyMasks {
+  int num_vertices = 0;
+  uint64_t neighbors[64];
+};
+
+/** A cheap structural test that shows, without computing distances, that the
+metric space of a connected graph has a universal line. **/
+class Prefilter {
+public:
+  explicit Prefilter(const std::string &name) : name_(name) {}
+  virtual ~Prefilter() {}
+
+  const std::string &name() const { return name_; }
+
+  /** Returns true if the metric space of the given connected graph is certain
+  to have a universal line. **/
+  virtual bool HasUniversalLine(const AdjacencyMasks &graph) const = 0;
+
+  unsigned long long num_tested = 0;
+  unsigned long long num_rejected = 0;
+
+private:
+  std::string name_;
+};
+
+/** A vertex of degree one together with its neighbor generates a universal
+line: every other vertex reaches the pendant vertex through its neighbor. **/
+class PendantVertexPrefilter : public Prefilter {
+public:
+  PendantVertexPrefilter() : Prefilter("pendant_vertex") {}
+  bool HasUniversalLine(const AdjacencyMasks &graph) const override;
+};
+
+/** The endpoints u and v of a bridge generate a universal line: every other
+vertex w lies on the side of one endpoint, say v, so that d(w, u) = d(w, v) +
+d(v, u). **/
+class BridgePrefilter : public Prefilter {
+public:
+  BridgePrefilter() : Prefilter("bridge") {}
+  bool HasUniversalLine(const AdjacencyMasks &graph) const override;
+};
+
+/** The pre-filters that apply to an analysis, run in order on every graph
+before its distances are computed, with statistics on how much they saved. **/
+class Prefilters {
+public:
+  /** Creates the pre-filters for the given analysis options. They only reject
+  metric spaces with a universal line, so there are none unless the options
+  skip those. **/
+  explicit Prefilters(const AnalysisOptions &options);
+
+  bool empty() const { return filters_.empty(); }
+
+  /** Returns true if some pre-filter shows that the metric space of the graph
+  has a universal line. Disconnected graphs, and graphs with more than 64
+  vertices, are never rejected. **/
+  bool Rejects(const Graph &graph);
+
+  /** Records the time taken to compute the distances of, and analyze, graphs
+  that were not rejected, for estimating the time saved. **/
+  void RecordAnalysis(unsigned long long num_graphs,
+                      std::chrono::nanoseconds time) {
+    num_analyzed_ += num_graphs;
+    analysis_time_ += time;
+  }
+
+  /** Writes the number of graphs rejected by each pre-filter, and the time
+  saved, to the given stream. **/
+  void PrintStatistics(std::ostream &stream) const;
+
+private:
+  std::vector<std::unique_ptr<Prefilter>> filters_;
+  unsigned long long num_analyzed_ = 0;
+  std::chrono::nanoseconds analysis_time_{0};
+  std::chrono::nanoseconds filter_time_{0};
+};
+
+#endif
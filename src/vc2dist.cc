@@ -8,6 +8,7 @@ Example usage:
 
 #include "common.h"
 #include "graphs.h"
+#include "io.h"
 #include <iostream>
 #include <math.h>
 #include <sstream>
@@ -50,7 +51,7 @@ int main(int argc, char *argv[]) {
     }
     int unused_num;
     stream >> unused_num;
-    std::cout << n;
+    std::string output = std::to_string(n);
     for (int i = 0; i < num_edges; ++i) {
       int label;
       stream >> label;
@@ -58,9 +59,11 @@ int main(int argc, char *argv[]) {
         Error("Invalid label: " + std::to_string(label));
       }
       int distance = distance_map[label];
-      std::cout << " " << distance;
+      output += " " + std::to_string(distance);
     }
-    std::cout << " matrix-" << n << "-" << index << std::endl;
+    output += " matrix-" + std::to_string(n) + "-" + std::to_string(index);
+    output += "\n";
+    WriteOutput(output);
     ++index;
   }
 }